@@ -1,573 +1,6486 @@
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <math.h>
-
- /*
- * des takes two arguments on the command line:
- *    des -enc -ecb      -- encrypt in ECB mode
- *    des -enc -ctr      -- encrypt in CTR mode
- *    des -dec -ecb      -- decrypt in ECB mode
- *    des -dec -ctr      -- decrypt in CTR mode
- * des also reads some hardcoded files:
- *    message.txt            -- the ASCII text message to be encrypted,
- *                              read by "des -enc"
- *    encrypted_msg.bin      -- the encrypted message, a binary file,
- *                              written by "des -enc"
- *    decrypted_message.txt  -- the decrypted ASCII text message
- *    key.txt                -- just contains the key, on a line by itself, as an ASCII 
- *                              hex number, such as: 0x34FA879B
-*/
-
-/*
-	Author: Chun Wu and Danny Nguyen
-*/
-
-/////////////////////////////////////////////////////////////////////////////
-// Type definitions
-/////////////////////////////////////////////////////////////////////////////
-typedef uint64_t KEYTYPE;
-typedef uint32_t SUBKEYTYPE;
-typedef uint64_t BLOCKTYPE;
-
-struct BLOCK {
-    BLOCKTYPE block;        // the block read
-    int size;               // number of "real" bytes in the block, should be 8, unless it's the last block
-    struct BLOCK *next;     // pointer to the next block
-};
-typedef struct BLOCK* BLOCKLIST;
-
-/////////////////////////////////////////////////////////////////////////////
-// Initial and final permutation
-/////////////////////////////////////////////////////////////////////////////
-uint64_t init_perm[] = {
-	58,50,42,34,26,18,10,2,
-	60,52,44,36,28,20,12,4,
-	62,54,46,38,30,22,14,6,
-	64,56,48,40,32,24,16,8,
-	57,49,41,33,25,17,9,1,
-	59,51,43,35,27,19,11,3,
-	61,53,45,37,29,21,13,5,
-	63,55,47,39,31,23,15,7
-};
-
-int final_perm[] = {
-	40,8,48,16,56,24,64,32,
-	39,7,47,15,55,23,63,31,
-	38,6,46,14,54,22,62,30,
-	37,5,45,13,53,21,61,29,
-	36,4,44,12,52,20,60,28,
-	35,3,43,11,51,19,59,27,
-	34,2,42,10,50,18,58,26,
-	33,1,41,9, 49,17,57,25
-};
-
-/////////////////////////////////////////////////////////////////////////////
-// Subkey generation
-/////////////////////////////////////////////////////////////////////////////
-uint64_t hardcoded_subkeys[] = 
-{
-	0x1b02effc7072,
-	0x79aed9dbc9e5,
-	0x55fc8a42cf99,
-	0x72add6db351d,
-	0x7cec07eb53a8,
-	0x63a53e507b2f,
-	0xec84b7f618bc,
-	0xf78a3ac13bfb,
-	0xe0dbebede781,
-	0xB1F347BA464F,
-	0x215FD3DED386,
-	0x7571F59467E9,
-	0x97C5D1FABA41,
-	0x5F43B7F2E73A,
-	0xBF918D3D3F0A,
-	0xCB3D8B0E17F5, 
-};
-
-// Each subkey is 48 bits. To simplify the assignment we're hardcoding keys here.
-// Note that this means that the key argument to this assignment doesn't matter at
-// all, since the subkeys are generated from the input key!
-uint64_t getSubKey(int i) {
-   return hardcoded_subkeys[i];
-}
-
-// For extra credit, write the key expansion routine.
-void generateSubKeys(KEYTYPE key) {
-   // TODO for extra credit
-}
-
-/////////////////////////////////////////////////////////////////////////////
-// P-boxes
-/////////////////////////////////////////////////////////////////////////////
-uint64_t expand_box[] = {
-	32,1,2,3,4,5,4,5,6,7,8,9,
-	8,9,10,11,12,13,12,13,14,15,16,17,
-	16,17,18,19,20,21,20,21,22,23,24,25,
-	24,25,26,27,28,29,28,29,30,31,32,1
-};
-
-uint32_t Pbox[] = 
-{
-	16,7,20,21,29,12,28,17,1,15,23,26,5,18,31,10,
-	2,8,24,14,32,27,3,9,19,13,30,6,22,11,4,25,
-};		
-
-/////////////////////////////////////////////////////////////////////////////
-// S-boxes
-/////////////////////////////////////////////////////////////////////////////
-uint64_t sbox_1[4][16] = {
-	{14,  4, 13,  1,  2, 15, 11,  8,  3, 10 , 6, 12,  5,  9,  0,  7},
-	{ 0, 15,  7,  4, 14,  2, 13,  1, 10,  6, 12, 11,  9,  5,  3,  8},
-	{ 4,  1, 14,  8, 13,  6,  2, 11, 15, 12,  9,  7,  3, 10,  5,  0},
-	{15, 12,  8,  2,  4,  9,  1,  7,  5, 11,  3, 14, 10,  0,  6, 13}};
-
-uint64_t sbox_2[4][16] = {
-	{15,  1,  8, 14,  6, 11,  3,  4,  9,  7,  2, 13, 12,  0,  5 ,10},
-	{ 3, 13,  4,  7, 15,  2,  8, 14, 12,  0,  1, 10,  6,  9, 11,  5},
-	{ 0, 14,  7, 11, 10,  4, 13,  1,  5,  8, 12,  6,  9,  3,  2, 15},
-	{13,  8, 10,  1,  3, 15,  4,  2, 11,  6,  7, 12,  0,  5, 14,  9}};
-
-uint64_t sbox_3[4][16] = {
-	{10,  0,  9, 14,  6,  3, 15,  5,  1, 13, 12,  7, 11,  4,  2,  8},
-	{13,  7,  0,  9,  3,  4,  6, 10,  2,  8,  5, 14, 12, 11, 15,  1},
-	{13,  6,  4,  9,  8, 15,  3,  0, 11,  1,  2, 12,  5, 10, 14,  7},
-	{ 1, 10, 13,  0,  6,  9,  8,  7,  4, 15, 14,  3, 11,  5,  2, 12}};
-
-
-uint64_t sbox_4[4][16] = {
-	{ 7, 13, 14,  3,  0 , 6,  9, 10,  1 , 2 , 8,  5, 11, 12,  4 ,15},
-	{13,  8, 11,  5,  6, 15,  0,  3,  4 , 7 , 2, 12,  1, 10, 14,  9},
-	{10,  6,  9 , 0, 12, 11,  7, 13 ,15 , 1 , 3, 14 , 5 , 2,  8,  4},
-	{ 3, 15,  0,  6, 10,  1, 13,  8,  9 , 4 , 5, 11 ,12 , 7,  2, 14}};
- 
- 
-uint64_t sbox_5[4][16] = {
-	{ 2, 12,  4,  1 , 7 ,10, 11,  6 , 8 , 5 , 3, 15, 13,  0, 14,  9},
-	{14, 11 , 2 ,12 , 4,  7, 13 , 1 , 5 , 0, 15, 10,  3,  9,  8,  6},
-	{ 4,  2 , 1, 11, 10, 13,  7 , 8 ,15 , 9, 12,  5,  6 , 3,  0, 14},
-	{11,  8 ,12 , 7 , 1, 14 , 2 ,13 , 6 ,15,  0,  9, 10 , 4,  5,  3}};
-
-
-uint64_t sbox_6[4][16] = {
-	{12,  1, 10, 15 , 9 , 2 , 6 , 8 , 0, 13 , 3 , 4 ,14 , 7  ,5 ,11},
-	{10, 15,  4,  2,  7, 12 , 9 , 5 , 6,  1 ,13 ,14 , 0 ,11 , 3 , 8},
-	{ 9, 14 ,15,  5,  2,  8 ,12 , 3 , 7 , 0,  4 ,10  ,1 ,13 ,11 , 6},
-	{ 4,  3,  2, 12 , 9,  5 ,15 ,10, 11 ,14,  1 , 7  ,6 , 0 , 8 ,13}};
- 
-
-uint64_t sbox_7[4][16] = {
-	{ 4, 11,  2, 14, 15,  0 , 8, 13, 3,  12 , 9 , 7,  6 ,10 , 6 , 1},
-	{13,  0, 11,  7,  4 , 9,  1, 10, 14 , 3 , 5, 12,  2, 15 , 8 , 6},
-	{ 1 , 4, 11, 13, 12,  3,  7, 14, 10, 15 , 6,  8,  0,  5 , 9 , 2},
-	{ 6, 11, 13 , 8,  1 , 4, 10,  7,  9 , 5 , 0, 15, 14,  2 , 3 ,12}};
- 
-uint64_t sbox_8[4][16] = {
-	{13,  2,  8,  4,  6 ,15 ,11,  1, 10,  9 , 3, 14,  5,  0, 12,  7},
-	{ 1, 15, 13,  8 ,10 , 3  ,7 , 4, 12 , 5,  6 ,11,  0 ,14 , 9 , 2},
-	{ 7, 11,  4,  1,  9, 12, 14 , 2,  0  ,6, 10 ,13 ,15 , 3  ,5  ,8},
-	{ 2,  1, 14 , 7 , 4, 10,  8, 13, 15, 12,  9,  0 , 3,  5 , 6 ,11}};
-
-void print_bits(BLOCKTYPE x)
-{
-    int i;
-    for(i=8*sizeof(x)-1; i>=0; i--) {
-        (x & (1 << i)) ? putchar('1') : putchar('0');
-    }
-    printf("\n");
-}
-
-/////////////////////////////////////////////////////////////////////////////
-// I/O
-/////////////////////////////////////////////////////////////////////////////
-
-// Pad the list of blocks, so that every block is 64 bits, even if the
-// file isn't a perfect multiple of 8 bytes long. In the input list of blocks,
-// the last block may have "size" < 8. In this case, it needs to be padded. See 
-// the slides for how to do this (the last byte of the last block 
-// should contain the number if real bytes in the block, add an extra block if
-// the file is an exact multiple of 8 bytes long.) The returned
-// list of blocks will always have the "size"-field=8.
-// Example:
-//    1) The last block is 5 bytes long: [10,20,30,40,50]. We pad it with 2 bytes,
-//       and set the length to 5: [10,20,30,40,50,0,0,5]. This means that the 
-//       first 5 bytes of the block are "real", the last 3 should be discarded.
-//    2) The last block is 8 bytes long: [10,20,30,40,50,60,70,80]. We keep this 
-//       block as is, and add a new final block: [0,0,0,0,0,0,0,0]. When we decrypt,
-//       the entire last block will be discarded since the last byte is 0
-BLOCKLIST pad_last_block(BLOCKLIST blocks) {
-	int pad = 0;
-	BLOCKLIST walker = blocks;
-	while (walker->next != NULL) {
-		walker = walker->next;
-	}
-	//Last Block
-	//Case 1: Last block is too short, pad it
-	if (walker->size < 8) {
-		pad = 8 - walker->size;
-		walker->block = walker->block<<((pad-1)*8);
-		BLOCKTYPE realBytes = walker->size;
-		walker->block = walker->block<<8;
-		walker->block |= realBytes;
-	//Case 2: Last block is 8 bytes exactly, make a empty block
-	} else {
-		BLOCKLIST finalBlock = 0;
-		walker->next = finalBlock;
-	}
-   return blocks;
-}
-
-// Reads the message to be encrypted, an ASCII text file, and returns a linked list 
-// of BLOCKs, each representing a 64 bit block. In other words, read the first 8 characters
-// from the input file, and convert them (just a C cast) to 64 bits; this is your first block.
-// Continue to the end of the file.
-BLOCKLIST read_cleartext_message(FILE *msg_fp) {
-	BLOCKLIST head = NULL;
-	BLOCKLIST walker;
-	char str[8];
-	int numElements = 0;
-	int c = 0;
-	int index = 0;
-	if (msg_fp) {
-		while ((c = fgetc(msg_fp)) != -1) {
-			str[index % 8] = c;
-			numElements++;
-			index++;
-			if (index == 8) {
-				walker->block = *((uint64_t *) str);
-				walker->size = numElements;
-				walker->next = NULL;
-				numElements = 0;
-				head = walker;
-				memset(str, 0, strlen(str));
-			} else if (index != 0 && index % 8 == 0) {
-				walker->next = malloc(sizeof(BLOCKLIST));
-				walker = walker->next;
-				walker->block = *( (uint64_t *) str);
-				walker->size = numElements;
-				walker->next = NULL;
-				numElements = 0;
-				memset(str, 0, strlen(str));
-			}
-		}
-		//File has less than 8 chars
-		if (index < 7) {
-			walker->block = *((uint64_t *) str);
-			walker->size = numElements;
-			walker->next = head;
-			numElements = 0;
-			head = walker;
-			memset(str, 0, strlen(str));
-		} else {
-			if (head->next == NULL) {
-				walker = malloc(sizeof(BLOCKLIST));
-				walker->block = *( (uint64_t *) str);
-				walker->size = numElements;
-				walker->next = NULL;
-				numElements = 0;
-				memset(str, 0, strlen(str));
-				head->next = walker;
-			} else {
-				walker = walker->next;
-				walker = malloc(sizeof(BLOCKLIST));
-				walker->block = *( (uint64_t *) str);
-				walker->size = numElements;
-				walker->next = NULL;
-				numElements = 0;
-				memset(str, 0, strlen(str));
-			}
-		}
-	}
-    // call pad_last_block() here to pad the last block!
-	head = pad_last_block(head);
-	fclose(msg_fp);
-   return head;
-}
-
-// Reads the encrypted message, and returns a linked list of blocks, each 64 bits. 
-// Note that, because of the padding that was done by the encryption, the length of 
-// this file should always be a multiople of 8 bytes. The output is a linked list of
-// 64-bit blocks.
-BLOCKLIST read_encrypted_file(FILE *msg_fp) {
-
-	BLOCKLIST head = NULL;
-	BLOCKLIST walker;
-	msg_fp = fopen("encrypted_msg.bin", "rb");
-	BLOCKTYPE buffer;
-	size_t bytes;
-	if (msg_fp) {
-		while ((bytes = fread(&buffer, 1, 8, msg_fp)) > 0 ) {
-			if (head == NULL) {
-				head = malloc(sizeof(BLOCKLIST));
-				head->block = buffer;
-				head->next = NULL;
-				head->size = bytes;
-			} else if (head->next == NULL) {
-				walker = malloc(sizeof(BLOCKLIST));
-				walker->block = buffer;
-				walker->next = NULL;
-				walker->size = bytes;
-				head->next = walker;
-			} else {
-				walker = head;
-				while (walker != NULL) {
-					walker = walker->next;
-				}
-				walker = malloc(sizeof(BLOCKLIST));
-				walker->block = buffer;
-				walker->next = NULL;
-				walker->size = bytes;
-			}
-		}
-	}
-	fclose(msg_fp);
-   return head;
-}
-
-// Reads 56-bit key into a 64 bit unsigned int. We will ignore the most significant byte,
-// i.e. we'll assume that the top 8 bits are all 0. In real DES, these are used to check 
-// that the key hasn't been corrupted in transit. The key file is ASCII, consisting of
-// exactly one line. That line has a single hex number on it, the key, such as 0x08AB674D9.
-KEYTYPE read_key(FILE *key_fp) {
-    // TODO
-   return 0;
-}
-
-// Write the encrypted blocks to file. The encrypted file is in binary, i.e., you can
-// just write each 64-bit block directly to the file, without any conversion.
-void write_encrypted_message(FILE *msg_fp, BLOCKLIST msg) {
-	msg_fp = fopen("encrypted_msg.bin","wb");
-
-	if (msg_fp) {
-		BLOCKLIST walker = msg;
-		while (walker != NULL) {
-			fwrite(&walker->block, sizeof(walker->block), 1, msg_fp);
-			walker = walker->next;
-		}
-	}
-	fclose(msg_fp);
-}
-
-// Write the encrypted blocks to file. This is called by the decryption routine.
-// The output file is a plain ASCII file, containing the decrypted text message.
-void write_decrypted_message(FILE *msg_fp, BLOCKLIST msg) {
-    // TODO
-
-}
-
-/////////////////////////////////////////////////////////////////////////////
-// Encryption
-/////////////////////////////////////////////////////////////////////////////
-
-/*
-	Performs the initial permutation step in encryption by moving bits according to the 
-	init_perm[] array.
-*/
-BLOCKTYPE initPermute(BLOCKTYPE b){
-    BLOCKTYPE masked;
-    BLOCKTYPE thebit;
-	BLOCKTYPE newBlock = 0;
-	BLOCKTYPE mask;
-	for (int i=0; i<64; i++) {
-		mask =  1 << (63 - init_perm[i]);
-		masked = b & mask;
-		thebit = masked >> (63 - init_perm[i]);
-		newBlock |= thebit;
-		newBlock = newBlock << 1;
-	}
-	for(int i = 63; i >= 0; i--){
-		mask =  1 << i;
-		BLOCKTYPE masked_n = newBlock & mask;
-		thebit = masked_n >> i;
-  	}
-	return newBlock;
-}
-
-/*
-	Applies the expansion box, similiar to permutation, moving around the bits, 
-	forming the 32 bit right into a 48 bit.
-*/
-
-BLOCKTYPE expand(BLOCKTYPE right) {
-	BLOCKTYPE newRight = 0;
-	BLOCKTYPE temp = 0;
-	BLOCKTYPE mask = 1;
-	int i;
-	for (i=0; i<48; i++) {
-		mask = mask<<(expand_box[i]-1);
-		temp = mask & right;
-		temp = temp>>(expand_box[i]-1);
-		newRight |= temp;
-		temp = 0;
-		mask = 1;
-	}
-
-	return newRight;
-}
-
-BLOCKTYPE f_function(BLOCKTYPE right, BLOCKTYPE key) {
-//  1.expand right
-	right = expand(right);
-//	2.XOR the expanded R and the compressed key,
-	right = right ^ key;
-
-//	3.Send the result through 8 S-boxes using the S-Box
-//	Substitution to get 32 new bits,
-	BLOCKTYPE inputBlock = 0;
-	BLOCKTYPE mask6Bit = 0;
-	int i;
-	mask6Bit = 1;
-	for (i=0; i<5; i++) {
-		mask6Bit = mask6Bit << 1;
-		mask6Bit += 1;
-	}
-	int row = 0;
-	int col = 0;
-
-	sbox_1[4][16];
-
-//	4. Permute the result using the P-Box Permutation
-
-}
-
-// Encrypt one block. This is where the main computation takes place. It takes
-// one 64-bit block as input, and returns the encrypted 64-bit block. The
-// subkeys needed by the Feistel Network is given by the function getSubKey(i).
-BLOCKTYPE des_enc(BLOCKTYPE v){
-	// TODO
-	//Step 1: Initially Permutate the block
-	v = initPermute(v);
-	//Step 2: Split the block into left and right
-	BLOCKTYPE left = 0;
-	BLOCKTYPE right = 0;
-	BLOCKTYPE mask = 1;
-	BLOCKTYPE mask2 = 1;
-	mask2 = mask2 << 32;
-	//put the first half of the bits with the left and the other half with the right
-	int i;
-	for (i=0; i<32; i++) {
-		right = v & mask;
-		left = v & mask2;
-		mask = mask << 1;
-		mask2 = mask2 << 1;
-	}
-//	right |= (uint32_t)v;
-//	left |= (v>>32);
-//	printf("Left:");
-//	print_bits(right);
-//	printf("Right:");
-//	print_bits(left);
-	//Step 3: 16 rounds of encrypting
-	// for (i=0; i<16; i++) {
-	// 	//left
-	// }
-
-   return v;
-}
-
-// Encrypt the blocks in ECB mode. The blocks have already been padded 
-// by the input routine. The output is an encrypted list of blocks.
-BLOCKLIST des_enc_ECB(BLOCKLIST msg) {
-    // TODO
-	BLOCKLIST walker = msg;
-	while (walker != NULL) {
-		walker->block = des_enc(walker->block);
-		walker = walker->next;
-	}
-    // Should call des_enc in here repeatedly
-   return msg;
-}
-
-// Same as des_enc_ECB, but encrypt the blocks in Counter mode.
-// SEE: https://en.wikipedia.org/wiki/Block_cipher_mode_of_operation#Counter_(CTR)
-// Start the counter at 0.
-BLOCKLIST des_enc_CTR(BLOCKLIST msg) {
-    // TODO
-    // Should call des_enc in here repeatedly
-   return NULL;
-}
-
-/////////////////////////////////////////////////////////////////////////////
-// Decryption
-/////////////////////////////////////////////////////////////////////////////
-// Decrypt one block.
-BLOCKTYPE des_dec(BLOCKTYPE v){
-    // TODO
-   return 0;
-}
-
-// Decrypt the blocks in ECB mode. The input is a list of encrypted blocks,
-// the output a list of plaintext blocks.
-BLOCKLIST des_dec_ECB(BLOCKLIST msg) {
-    // TODO
-    // Should call des_dec in here repeatedly
-   return NULL;
-}
-
-// Decrypt the blocks in Counter mode
-BLOCKLIST des_dec_CTR(BLOCKLIST msg) {
-    // TODO
-    // Should call des_enc in here repeatedly
-   return NULL;
-}
-
-/////////////////////////////////////////////////////////////////////////////
-// Main routine
-/////////////////////////////////////////////////////////////////////////////
-
-void encrypt (int argc, char **argv) {
-     FILE *msg_fp = fopen("message.txt", "r");
-     BLOCKLIST msg = read_cleartext_message(msg_fp);
-     fclose(msg_fp);
-
-     BLOCKLIST encrypted_message;
-     if (!strcmp(argv[2], "-ecb")) {
-        encrypted_message = des_enc_ECB(msg);
-     } else if (!strcmp(argv[2], "-ctr")) {
-        encrypted_message = des_enc_CTR(msg);
-     } else {
-        printf("No such mode.\n");
-     };
-     FILE *encrypted_msg_fp = fopen("encrypted_msg.bin", "wb");
-     write_encrypted_message(encrypted_msg_fp, encrypted_message);
-     fclose(encrypted_msg_fp);
-}
-
-void decrypt (int argc, char **argv) {
-//      FILE *encrypted_msg_fp = fopen("encrypted_msg.bin", "wb");
-	  FILE *encrypted_msg_fp = fopen("encrypted_msg.bin", "r");
-     BLOCKLIST encrypted_message = read_encrypted_file(encrypted_msg_fp);
-     fclose(encrypted_msg_fp);
-
-     BLOCKLIST decrypted_message;
-     if (!strcmp(argv[2], "-ecb")) {
-        decrypted_message = des_dec_ECB(encrypted_message);
-     } else if (!strcmp(argv[2], "-ctr")) {
-        encrypted_message = des_dec_CTR(encrypted_message);
-     } else {
-        printf("No such mode.\n");
-     };
-
-//      FILE *decrypted_msg_fp = fopen("decrypted_message.txt", "r");
-     FILE *decrypted_msg_fp = fopen("decrypted_message.txt", "wb");
-     write_decrypted_message(decrypted_msg_fp, decrypted_message);
-     fclose(decrypted_msg_fp);
-}
-
-
-int main(int argc, char **argv){
-  FILE *key_fp = fopen("key.txt","r");
-  KEYTYPE key = read_key(key_fp);
-  generateSubKeys(key);              // This does nothing right now.
-  fclose(key_fp);
-
-  if (!strcmp(argv[1], "-enc")) {
-     encrypt(argc, argv);
-  } else if (!strcmp(argv[1], "-dec")) {
-     decrypt(argc, argv);
-  } else {
-    printf("First argument should be -enc or -dec\n");
-  }
-   return 0;
-}
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include "DES.h"
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+ /*
+ * des takes two arguments on the command line:
+ *    des -enc -ecb      -- encrypt in ECB mode
+ *    des -enc -ctr      -- encrypt in CTR mode
+ *    des -dec -ecb      -- decrypt in ECB mode
+ *    des -dec -ctr      -- decrypt in CTR mode
+ * optional flags after the mode:
+ *    -prefetch [N]      -- CTR only: precompute the keystream on N background
+ *                          threads (default: all cores but one) and print how
+ *                          far ahead it ran to stderr
+ *    -batch LIST        -- process every file named in LIST (one per line), or
+ *                          every file in LIST if it's a directory, instead of
+ *                          the hardcoded files; F is encrypted to F.des
+ *    -threads N         -- number of worker threads (default: see -tune)
+ *    -mac               -- append a CMAC tag, computed in the same pass as the
+ *                          encryption, and check it when decrypting
+ *    -armor hex|base64  -- write the ciphertext as text, and read it back as
+ *                          text when decrypting
+ *    -numa              -- pin the -batch workers to the NUMA nodes
+ *    -z                 -- compress the message before encrypting it, and
+ *                          decompress it after decrypting
+ *    -checkpoint [MB]   -- stream the files, saving a checkpoint every MB
+ *                          megabytes (default 256) next to the output
+ *    -resume            -- continue from the last checkpoint after a crash
+ *    -trace FILE        -- record when each thread reads, pads, encrypts and
+ *                          writes each chunk, as Chrome/Perfetto trace JSON
+ *    -offset N          -- decrypt only: start at byte N of the message and
+ *                          write to stdout, decrypting only what's needed
+ *    -length N          -- decrypt only: stop after N bytes, same as above
+ * -enc and -dec exit with 1 if anything failed, such as a CMAC tag or the
+ * padding not matching (a damaged message or the wrong key).
+ * other commands:
+ *    des -bench -scaling -- encryption throughput on 1, 2, ... NUMA nodes
+ *    des -bench -latency -- p50/p99/p999 time to encrypt one 1-8 block message
+ *    des -bench -keys    -- key schedules per second, one key and 64 at a time
+ *    des -bench -streams -- many small messages with many keys from many
+ *                           threads, alone and batched across messages;
+ *                           -messages N, -size BYTES, -clients N, -depth N
+ *                           (messages in flight per client), -threads N
+ *                           (batcher threads), -delay US (longest wait for a
+ *                           full batch)
+ *    des -mitm BITS      -- meet-in-the-middle attack on double DES with keys
+ *                           of BITS bits; -threads N, -mem MB (spill to disk
+ *                           past that), -spill DIR (where)
+ *    des -tune           -- time the engines, thread counts and chunk sizes on
+ *                           this host and save the best in ~/.des_tune.<host>
+ *                           (done automatically the first time des runs)
+ *    des -check          -- check every engine and message path against
+ *                           des_enc/des_dec and known-answer vectors, and
+ *                           each engine's speed against ~/.des_check.<host>;
+ *                           exits with 1 on any failure. -threshold PCT
+ *                           (slowdown allowed, default 25), -baseline FILE,
+ *                           -save (write the baseline; there must be one),
+ *                           -seed N
+ * des also reads some hardcoded files:
+ *    message.txt            -- the ASCII text message to be encrypted,
+ *                              read by "des -enc"
+ *    encrypted_msg.bin      -- the encrypted message, a binary file,
+ *                              written by "des -enc"
+ *    decrypted_message.txt  -- the decrypted ASCII text message
+ *    key.txt                -- just contains the key, on a line by itself, as an ASCII 
+ *                              hex number, such as: 0x34FA879B
+*/
+
+/*
+	Author: Chun Wu and Danny Nguyen
+*/
+
+/////////////////////////////////////////////////////////////////////////////
+// Type definitions
+/////////////////////////////////////////////////////////////////////////////
+typedef uint64_t KEYTYPE;
+typedef uint32_t SUBKEYTYPE;
+typedef uint64_t BLOCKTYPE;
+
+struct BLOCK {
+    BLOCKTYPE block;        // the block read
+    int size;               // number of "real" bytes in the block, should be 8, unless it's the last block
+    struct BLOCK *next;     // pointer to the next block
+};
+typedef struct BLOCK* BLOCKLIST;
+
+/////////////////////////////////////////////////////////////////////////////
+// Initial and final permutation
+/////////////////////////////////////////////////////////////////////////////
+uint64_t init_perm[] = {
+	58,50,42,34,26,18,10,2,
+	60,52,44,36,28,20,12,4,
+	62,54,46,38,30,22,14,6,
+	64,56,48,40,32,24,16,8,
+	57,49,41,33,25,17,9,1,
+	59,51,43,35,27,19,11,3,
+	61,53,45,37,29,21,13,5,
+	63,55,47,39,31,23,15,7
+};
+
+int final_perm[] = {
+	40,8,48,16,56,24,64,32,
+	39,7,47,15,55,23,63,31,
+	38,6,46,14,54,22,62,30,
+	37,5,45,13,53,21,61,29,
+	36,4,44,12,52,20,60,28,
+	35,3,43,11,51,19,59,27,
+	34,2,42,10,50,18,58,26,
+	33,1,41,9, 49,17,57,25
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Subkey generation
+/////////////////////////////////////////////////////////////////////////////
+uint64_t hardcoded_subkeys[] = 
+{
+	0x1b02effc7072,
+	0x79aed9dbc9e5,
+	0x55fc8a42cf99,
+	0x72add6db351d,
+	0x7cec07eb53a8,
+	0x63a53e507b2f,
+	0xec84b7f618bc,
+	0xf78a3ac13bfb,
+	0xe0dbebede781,
+	0xB1F347BA464F,
+	0x215FD3DED386,
+	0x7571F59467E9,
+	0x97C5D1FABA41,
+	0x5F43B7F2E73A,
+	0xBF918D3D3F0A,
+	0xCB3D8B0E17F5, 
+};
+
+// Each subkey is 48 bits. The hardcoded ones above are those of the key
+// 133457799BBCDFF1, and are used when there's no key file; otherwise
+// generateSubKeys replaces them with the subkeys of the key in it.
+static uint64_t *subkeys_in_use = hardcoded_subkeys;
+static uint64_t generated_subkeys[16];
+
+uint64_t getSubKey(int i) {
+   return subkeys_in_use[i];
+}
+
+// Permuted choices 1 and 2 and the rotations of the key schedule (FIPS 46-3).
+// Bit 1 is the most significant bit, as everywhere else.
+int pc1[] = {
+	57,49,41,33,25,17,9, 1,58,50,42,34,26,18,
+	10,2,59,51,43,35,27, 19,11,3,60,52,44,36,
+	63,55,47,39,31,23,15, 7,62,54,46,38,30,22,
+	14,6,61,53,45,37,29, 21,13,5,28,20,12,4
+};
+
+int pc2[] = {
+	14,17,11,24,1,5, 3,28,15,6,21,10,
+	23,19,12,4,26,8, 16,7,27,20,13,2,
+	41,52,31,37,47,55, 30,40,51,45,33,48,
+	44,49,39,56,34,53, 46,42,50,36,29,32
+};
+
+int key_shifts[] = { 1,1,2,2,2,2,2,2,1,2,2,2,2,2,2,1 };
+
+// Our keys are 56 bits; PC-1 expects 64 with a parity bit at the bottom of
+// each byte. Spread the key out that way, leaving the parity bits 0.
+uint64_t key_with_parity(KEYTYPE key) {
+	uint64_t k = 0;
+	int i;
+	for (i=0; i<8; i++) {
+		k |= ((key >> (49 - 7*i)) & 0x7f) << (57 - 8*i);
+	}
+	return k;
+}
+
+// The other way around, for keys written with their parity bits.
+KEYTYPE key_without_parity(uint64_t k) {
+	KEYTYPE key = 0;
+	int i;
+	for (i=0; i<8; i++) {
+		key = (key << 7) | ((k >> (57 - 8*i)) & 0x7f);
+	}
+	return key;
+}
+
+// The 16 48-bit subkeys for key, in the form getSubKey returns them.
+void key_schedule(KEYTYPE key, uint64_t subkeys[16]) {
+	uint64_t k = key_with_parity(key), cd = 0;
+	int i, round;
+	for (i=0; i<56; i++) {
+		cd = (cd << 1) | ((k >> (64 - pc1[i])) & 1);
+	}
+	uint32_t c = (uint32_t) (cd >> 28), d = (uint32_t) (cd & 0xfffffff);
+	for (round=0; round<16; round++) {
+		int s = key_shifts[round];
+		c = ((c << s) | (c >> (28 - s))) & 0xfffffff;
+		d = ((d << s) | (d >> (28 - s))) & 0xfffffff;
+		cd = ((uint64_t) c << 28) | d;
+		uint64_t subkey = 0;
+		for (i=0; i<48; i++) {
+			subkey = (subkey << 1) | ((cd >> (56 - pc2[i])) & 1);
+		}
+		subkeys[round] = subkey;
+	}
+}
+
+// key_schedule is one bit at a time. For a key search or a batch with a key
+// per tenant, key_schedule_bulk and key_schedule_bulk_table expand up to 64
+// keys at once, bitsliced: after a 64x64 bit transpose, word x holds bit x of
+// all 64 keys. PC-1, the rotations and PC-2 only move bits around, so every
+// subkey bit of every round is then just one of those 56 words (key_source
+// says which); a round's 48 words are transposed back with the bits already
+// in the order the caller wants, which is the getSubKey form for
+// key_schedule_bulk and the engines' 6-bit pieces for key_schedule_bulk_table.
+#define KEY_BATCH 64
+
+static unsigned char key_source[16][48];   // key bit (0 = MSB of 56) of each subkey bit
+static unsigned char key_row_subkey[48];    // where each subkey bit goes, getSubKey form
+static unsigned char key_row_table[48];     // the same, the engines' 6-bit pieces
+static pthread_once_t key_source_once = PTHREAD_ONCE_INIT;
+
+// Built once; only read after that, by any number of threads at a time.
+static void key_source_build(void) {
+	int round, b, shift = 0;
+	for (b=0; b<48; b++) {
+		key_row_subkey[b] = 16 + b;                         // lands in bit 47-b
+		key_row_table[b] = 63 - (8 * (b / 6) + 5 - b % 6);  // bit 5-(b%6) of byte b/6
+	}
+	for (round=0; round<16; round++) {
+		shift += key_shifts[round];
+		for (b=0; b<48; b++) {
+			int cd = pc2[b] - 1;                                  // position in C||D
+			int half = cd < 28 ? 0 : 28;
+			int from = half + (cd - half + shift) % 28;          // before the rotations
+			int p = pc1[from] - 1;                                // position in the 64-bit key
+			key_source[round][b] = (unsigned char) (7 * (p / 8) + p % 8);
+		}
+	}
+}
+
+// Transpose a 64x64 bit matrix, bit 63 being column 0: afterwards bit 63-j of
+// a[i] is what bit 63-i of a[j] was.
+static void transpose64(uint64_t a[64]) {
+	uint64_t m = 0x00000000ffffffffULL;
+	int j, k;
+	for (j=32; j!=0; j>>=1, m^=m<<j) {
+		for (k=0; k<64; k=((k|j)+1)&~j) {
+			uint64_t t = (a[k] ^ (a[k|j] >> j)) & m;
+			a[k] ^= t;
+			a[k|j] ^= t << j;
+		}
+	}
+}
+
+// Bit-slice n keys (at most 64): afterwards slices[8+x] holds bit x of every
+// key, key k in bit 63-k.
+static void key_slices(const KEYTYPE *keys, int n, uint64_t slices[64]) {
+	int k;
+	pthread_once(&key_source_once, key_source_build);
+	for (k=0; k<64; k++) {
+		slices[k] = k < n ? keys[k] & 0x00FFFFFFFFFFFFFFULL : 0;
+	}
+	transpose64(slices);
+}
+
+// Put subkey bit b of "round" into row[b], transpose, and leave key k's
+// result in rows[k].
+static void key_round(const uint64_t slices[64], int round, const unsigned char *row, uint64_t rows[64]) {
+	int b;
+	memset(rows, 0, 64 * sizeof(uint64_t));
+	for (b=0; b<48; b++) {
+		rows[row[b]] = slices[8 + key_source[round][b]];
+	}
+	transpose64(rows);
+}
+
+// The 16 subkeys of each of n keys (n at most KEY_BATCH), like key_schedule.
+void key_schedule_bulk(const KEYTYPE *keys, int n, uint64_t (*subkeys)[16]) {
+	uint64_t slices[64], rows[64];
+	int k, round;
+	key_slices(keys, n, slices);
+	for (round=0; round<16; round++) {
+		key_round(slices, round, key_row_subkey, rows);
+		for (k=0; k<n; k++) {
+			subkeys[k][round] = rows[k];
+		}
+	}
+}
+
+// The same, but as the encryption and decryption schedules of the table and
+// SIMD engines (what table_cut_subkeys makes). Either may be NULL.
+void key_schedule_bulk_table(const KEYTYPE *keys, int n, unsigned char (*enc)[16][8], unsigned char (*dec)[16][8]) {
+	uint64_t slices[64], rows[64];
+	int j, k, round;
+	key_slices(keys, n, slices);
+	for (round=0; round<16; round++) {
+		key_round(slices, round, key_row_table, rows);
+		for (k=0; k<n; k++) {
+			for (j=0; j<8; j++) {
+				unsigned char piece = (unsigned char) (rows[k] >> (8*j));
+				if (enc != NULL) {
+					enc[k][round][j] = piece;
+				}
+				if (dec != NULL) {
+					dec[k][15 - round][j] = piece;
+				}
+			}
+		}
+	}
+}
+
+// The key expansion routine: from now on getSubKey returns the subkeys of
+// key. The engines cut the subkeys up the first time they're used, so call
+// this before that (or call table_load_subkeys afterwards).
+void generateSubKeys(KEYTYPE key) {
+	key_schedule_bulk(&key, 1, &generated_subkeys);
+	subkeys_in_use = generated_subkeys;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// P-boxes
+/////////////////////////////////////////////////////////////////////////////
+uint64_t expand_box[] = {
+	32,1,2,3,4,5,4,5,6,7,8,9,
+	8,9,10,11,12,13,12,13,14,15,16,17,
+	16,17,18,19,20,21,20,21,22,23,24,25,
+	24,25,26,27,28,29,28,29,30,31,32,1
+};
+
+uint32_t Pbox[] = 
+{
+	16,7,20,21,29,12,28,17,1,15,23,26,5,18,31,10,
+	2,8,24,14,32,27,3,9,19,13,30,6,22,11,4,25,
+};		
+
+/////////////////////////////////////////////////////////////////////////////
+// S-boxes
+/////////////////////////////////////////////////////////////////////////////
+uint64_t sbox_1[4][16] = {
+	{14,  4, 13,  1,  2, 15, 11,  8,  3, 10 , 6, 12,  5,  9,  0,  7},
+	{ 0, 15,  7,  4, 14,  2, 13,  1, 10,  6, 12, 11,  9,  5,  3,  8},
+	{ 4,  1, 14,  8, 13,  6,  2, 11, 15, 12,  9,  7,  3, 10,  5,  0},
+	{15, 12,  8,  2,  4,  9,  1,  7,  5, 11,  3, 14, 10,  0,  6, 13}};
+
+uint64_t sbox_2[4][16] = {
+	{15,  1,  8, 14,  6, 11,  3,  4,  9,  7,  2, 13, 12,  0,  5 ,10},
+	{ 3, 13,  4,  7, 15,  2,  8, 14, 12,  0,  1, 10,  6,  9, 11,  5},
+	{ 0, 14,  7, 11, 10,  4, 13,  1,  5,  8, 12,  6,  9,  3,  2, 15},
+	{13,  8, 10,  1,  3, 15,  4,  2, 11,  6,  7, 12,  0,  5, 14,  9}};
+
+uint64_t sbox_3[4][16] = {
+	{10,  0,  9, 14,  6,  3, 15,  5,  1, 13, 12,  7, 11,  4,  2,  8},
+	{13,  7,  0,  9,  3,  4,  6, 10,  2,  8,  5, 14, 12, 11, 15,  1},
+	{13,  6,  4,  9,  8, 15,  3,  0, 11,  1,  2, 12,  5, 10, 14,  7},
+	{ 1, 10, 13,  0,  6,  9,  8,  7,  4, 15, 14,  3, 11,  5,  2, 12}};
+
+
+uint64_t sbox_4[4][16] = {
+	{ 7, 13, 14,  3,  0 , 6,  9, 10,  1 , 2 , 8,  5, 11, 12,  4 ,15},
+	{13,  8, 11,  5,  6, 15,  0,  3,  4 , 7 , 2, 12,  1, 10, 14,  9},
+	{10,  6,  9 , 0, 12, 11,  7, 13 ,15 , 1 , 3, 14 , 5 , 2,  8,  4},
+	{ 3, 15,  0,  6, 10,  1, 13,  8,  9 , 4 , 5, 11 ,12 , 7,  2, 14}};
+ 
+ 
+uint64_t sbox_5[4][16] = {
+	{ 2, 12,  4,  1 , 7 ,10, 11,  6 , 8 , 5 , 3, 15, 13,  0, 14,  9},
+	{14, 11 , 2 ,12 , 4,  7, 13 , 1 , 5 , 0, 15, 10,  3,  9,  8,  6},
+	{ 4,  2 , 1, 11, 10, 13,  7 , 8 ,15 , 9, 12,  5,  6 , 3,  0, 14},
+	{11,  8 ,12 , 7 , 1, 14 , 2 ,13 , 6 ,15,  0,  9, 10 , 4,  5,  3}};
+
+
+uint64_t sbox_6[4][16] = {
+	{12,  1, 10, 15 , 9 , 2 , 6 , 8 , 0, 13 , 3 , 4 ,14 , 7  ,5 ,11},
+	{10, 15,  4,  2,  7, 12 , 9 , 5 , 6,  1 ,13 ,14 , 0 ,11 , 3 , 8},
+	{ 9, 14 ,15,  5,  2,  8 ,12 , 3 , 7 , 0,  4 ,10  ,1 ,13 ,11 , 6},
+	{ 4,  3,  2, 12 , 9,  5 ,15 ,10, 11 ,14,  1 , 7  ,6 , 0 , 8 ,13}};
+ 
+
+uint64_t sbox_7[4][16] = {
+	{ 4, 11,  2, 14, 15,  0 , 8, 13, 3,  12 , 9 , 7,  5 ,10 , 6 , 1},
+	{13,  0, 11,  7,  4 , 9,  1, 10, 14 , 3 , 5, 12,  2, 15 , 8 , 6},
+	{ 1 , 4, 11, 13, 12,  3,  7, 14, 10, 15 , 6,  8,  0,  5 , 9 , 2},
+	{ 6, 11, 13 , 8,  1 , 4, 10,  7,  9 , 5 , 0, 15, 14,  2 , 3 ,12}};
+ 
+uint64_t sbox_8[4][16] = {
+	{13,  2,  8,  4,  6 ,15 ,11,  1, 10,  9 , 3, 14,  5,  0, 12,  7},
+	{ 1, 15, 13,  8 ,10 , 3  ,7 , 4, 12 , 5,  6 ,11,  0 ,14 , 9 , 2},
+	{ 7, 11,  4,  1,  9, 12, 14 , 2,  0  ,6, 10 ,13 ,15 , 3  ,5  ,8},
+	{ 2,  1, 14 , 7 , 4, 10,  8, 13, 15, 12,  9,  0 , 3,  5 , 6 ,11}};
+
+void print_bits(BLOCKTYPE x)
+{
+    int i;
+    for(i=8*sizeof(x)-1; i>=0; i--) {
+        (x & (1 << i)) ? putchar('1') : putchar('0');
+    }
+    printf("\n");
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Tracing
+/////////////////////////////////////////////////////////////////////////////
+
+// "-trace FILE" records a span for every read, pad, cipher, write (and armor,
+// compress, keystream) step, on every thread, and writes them at exit in the
+// Chrome trace event format, which chrome://tracing and Perfetto open; each
+// thread gets its own row, which shows where the workers sit idle.
+// Each thread appends to its own buffer, so recording an event takes no lock
+// and touches no shared cache line. A thread's buffer is made the first time
+// it records something, and pushed onto a list with a compare-and-swap; the
+// list is only read once every thread is done. Events past TRACE_EVENTS per
+// thread are dropped (and counted).
+#define TRACE_EVENTS (1 << 15)
+
+struct TRACEEVENT {
+	const char *name;
+	uint64_t start;         // ns since the trace started
+	uint64_t dur;
+	uint64_t bytes;
+};
+
+struct TRACEBUF {
+	struct TRACEBUF *next;
+	int tid;
+	char name[32];
+	size_t count;
+	size_t dropped;
+	struct TRACEEVENT events[TRACE_EVENTS];
+};
+
+int trace_enabled = 0;
+static uint64_t trace_epoch;
+static struct TRACEBUF *trace_threads = NULL;
+static int trace_tids = 0;
+static __thread struct TRACEBUF *trace_mine = NULL;
+static __thread const char *trace_thread_label = "main";
+static __thread int trace_thread_index = 0;
+
+static uint64_t trace_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void trace_start(void) {
+	trace_epoch = trace_clock();
+	trace_enabled = 1;
+}
+
+// Name the calling thread's row, e.g. "worker" 3. Call before it records anything.
+void trace_name_thread(const char *label, int index) {
+	trace_thread_label = label;
+	trace_thread_index = index;
+}
+
+// Start of a span: pass the result to trace_end. 0 when not tracing.
+static inline uint64_t trace_begin(void) {
+	return trace_enabled ? trace_clock() : 0;
+}
+
+// Record the span "name" (a string literal) that started at "start".
+void trace_end(const char *name, uint64_t start, size_t bytes) {
+	if (!trace_enabled || start == 0) {
+		return;
+	}
+	uint64_t end = trace_clock();
+	struct TRACEBUF *buf = trace_mine;
+	if (buf == NULL) {
+		buf = malloc(sizeof(struct TRACEBUF));
+		if (buf == NULL) {
+			return;
+		}
+		buf->tid = __sync_add_and_fetch(&trace_tids, 1);
+		snprintf(buf->name, sizeof(buf->name), "%s %d", trace_thread_label, trace_thread_index);
+		buf->count = 0;
+		buf->dropped = 0;
+		do {
+			buf->next = trace_threads;
+		} while (!__sync_bool_compare_and_swap(&trace_threads, buf->next, buf));
+		trace_mine = buf;
+	}
+	if (buf->count == TRACE_EVENTS) {
+		buf->dropped++;
+		return;
+	}
+	struct TRACEEVENT *e = &buf->events[buf->count++];
+	e->name = name;
+	e->start = start - trace_epoch;
+	e->dur = end - start;
+	e->bytes = bytes;
+}
+
+// Write everything recorded to path and free the buffers. Only call this once
+// the other threads have finished.
+int trace_write(const char *path) {
+	FILE *fp = fopen(path, "w");
+	struct TRACEBUF *buf, *next;
+	size_t i, dropped = 0;
+	int first = 1;
+	trace_enabled = 0;
+	if (fp != NULL) {
+		fprintf(fp, "{\"traceEvents\":[\n");
+	}
+	for (buf=trace_threads; buf!=NULL; buf=next) {
+		next = buf->next;
+		if (fp != NULL) {
+			fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+					first ? "" : ",\n", buf->tid, buf->name);
+			first = 0;
+			for (i=0; i<buf->count; i++) {
+				struct TRACEEVENT *e = &buf->events[i];
+				fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"des\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+						"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%llu}}",
+						e->name, buf->tid, e->start / 1e3, e->dur / 1e3, (unsigned long long) e->bytes);
+			}
+		}
+		dropped += buf->dropped;
+		free(buf);
+	}
+	trace_threads = NULL;
+	trace_mine = NULL;
+	if (fp == NULL) {
+		fprintf(stderr, "trace: can't write %s\n", path);
+		return -1;
+	}
+	fprintf(fp, "\n]}\n");
+	if (dropped > 0) {
+		fprintf(stderr, "trace: %zu events dropped, the per-thread buffers were full\n", dropped);
+	}
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// I/O
+/////////////////////////////////////////////////////////////////////////////
+
+// Pad the list of blocks, so that every block is 64 bits, even if the
+// file isn't a perfect multiple of 8 bytes long. In the input list of blocks,
+// the last block may have "size" < 8. In this case, it needs to be padded. See 
+// the slides for how to do this (the last byte of the last block 
+// should contain the number if real bytes in the block, add an extra block if
+// the file is an exact multiple of 8 bytes long.) The returned
+// list of blocks will always have the "size"-field=8.
+// Example:
+//    1) The last block is 5 bytes long: [10,20,30,40,50]. We pad it with 2 bytes,
+//       and set the length to 5: [10,20,30,40,50,0,0,5]. This means that the 
+//       first 5 bytes of the block are "real", the last 3 should be discarded.
+//    2) The last block is 8 bytes long: [10,20,30,40,50,60,70,80]. We keep this 
+//       block as is, and add a new final block: [0,0,0,0,0,0,0,0]. When we decrypt,
+//       the entire last block will be discarded since the last byte is 0
+BLOCKLIST pad_last_block(BLOCKLIST blocks) {
+	BLOCKLIST walker = blocks;
+	while (walker->next != NULL) {
+		walker = walker->next;
+	}
+	//Last Block
+	//The reader always ends the list with a block of "size" 0-7, so both
+	//cases come down to padding it: an exact multiple of 8 ends in an empty
+	//block, which becomes all zeros.
+	unsigned char *bytes = (unsigned char *) &walker->block;
+	memset(bytes + walker->size, 0, 8 - walker->size);
+	bytes[7] = (unsigned char) walker->size;
+	walker->size = 8;
+   return blocks;
+}
+
+// Storage for big block buffers and BLOCK lists. Anything under a huge page
+// comes from malloc: a short message shouldn't fault in and zero a whole
+// 2 MB page. On Linux the rest comes straight from mmap, in whole huge pages
+// if any are reserved, and otherwise marked for transparent huge pages, to
+// cut down on TLB misses. Nothing is touched here, so every page ends up on
+// the NUMA node of the thread that writes it first.
+#define HUGE_PAGE (2UL << 20)
+
+void *alloc_block_storage(size_t size) {
+	if (size < HUGE_PAGE) {
+		return malloc(size);
+	}
+#ifdef __linux__
+	size_t rounded = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	void *p = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			return NULL;
+		}
+		madvise(p, rounded, MADV_HUGEPAGE);
+	}
+	return p;
+#else
+	return malloc(size);
+#endif
+}
+
+// size has to be the one p was allocated with.
+void free_block_storage(void *p, size_t size) {
+	if (p == NULL) {
+		return;
+	}
+#ifdef __linux__
+	if (size >= HUGE_PAGE) {
+		munmap(p, (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+		return;
+	}
+#endif
+	free(p);
+}
+
+// Size of the file behind fp, from the current position on, or -1.
+long remaining_file_size(FILE *fp) {
+	long here = ftell(fp);
+	if (here < 0 || fseek(fp, 0, SEEK_END) != 0) {
+		return -1;
+	}
+	long end = ftell(fp);
+	fseek(fp, here, SEEK_SET);
+	return end - here;
+}
+
+// The list path traces a message LIST_CHUNK bytes at a time: one read,
+// cipher and write span per chunk, with the bytes it covered, so a big
+// message shows up as a run of spans instead of one per stage.
+#define LIST_CHUNK (256 << 10)
+
+// Read the rest of fp into a list of n blocks, all in one piece of block
+// storage instead of a malloc per node. The last block gets the leftover
+// bytes (possibly none), the others are full.
+BLOCKLIST read_blocks(FILE *fp, size_t n) {
+	BLOCKLIST blocks = alloc_block_storage(n * sizeof(struct BLOCK));
+	size_t i, traced = 0;
+	if (blocks == NULL) {
+		return NULL;
+	}
+	uint64_t t = trace_begin();
+	for (i=0; i<n; i++) {
+		blocks[i].block = 0;
+		blocks[i].size = (int) fread(&blocks[i].block, 1, 8, fp);
+		blocks[i].next = i+1 < n ? &blocks[i+1] : NULL;
+		traced += blocks[i].size;
+		if ((i+1) % (LIST_CHUNK / 8) == 0 || i+1 == n) {
+			trace_end("read", t, traced);
+			t = trace_begin();
+			traced = 0;
+		}
+	}
+	return blocks;
+}
+
+// Reads the message to be encrypted, an ASCII text file, and returns a linked list 
+// of BLOCKs, each representing a 64 bit block. In other words, read the first 8 characters
+// from the input file, and convert them (just a C cast) to 64 bits; this is your first block.
+// Continue to the end of the file.
+BLOCKLIST read_cleartext_message(FILE *msg_fp) {
+	long size = msg_fp ? remaining_file_size(msg_fp) : -1;
+	if (size < 0) {
+		return NULL;
+	}
+	BLOCKLIST head = read_blocks(msg_fp, size / 8 + 1);
+	if (head == NULL) {
+		return NULL;
+	}
+    // call pad_last_block() here to pad the last block!
+	uint64_t t = trace_begin();
+	head = pad_last_block(head);
+	trace_end("pad", t, 8 - size % 8);
+   return head;
+}
+
+// Reads the encrypted message, and returns a linked list of blocks, each 64 bits. 
+// Note that, because of the padding that was done by the encryption, the length of 
+// this file should always be a multiople of 8 bytes. The output is a linked list of
+// 64-bit blocks.
+BLOCKLIST read_encrypted_file(FILE *msg_fp) {
+	long size = msg_fp ? remaining_file_size(msg_fp) : -1;
+	if (size <= 0 || size % 8 != 0) {
+		return NULL;
+	}
+	return read_blocks(msg_fp, size / 8);
+}
+
+// Value of one hex digit, or -1.
+int hex_value(int c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+// Reads 56-bit key into a 64 bit unsigned int. We will ignore the most significant byte,
+// i.e. we'll assume that the top 8 bits are all 0. In real DES, these are used to check 
+// that the key hasn't been corrupted in transit. The key file is ASCII, consisting of
+// exactly one line. That line has a single hex number on it, the key, such as 0x08AB674D9.
+// Returns 0, or -1 if the line isn't a hex number (anything but white space
+// after it included) or the number doesn't fit in 56 bits.
+int read_key(FILE *key_fp, KEYTYPE *key) {
+	char line[64];
+	int i, start, v;
+	*key = 0;
+	if (key_fp == NULL || fgets(line, sizeof(line), key_fp) == NULL) {
+		return -1;
+	}
+	start = i = (line[0] == '0' && (line[1] == 'x' || line[1] == 'X')) ? 2 : 0;
+	for (; (v = hex_value(line[i])) >= 0; i++) {
+		if (*key >> 52 != 0) {
+			return -1;
+		}
+		*key = (*key << 4) | v;
+	}
+	if (i == start) {
+		return -1;
+	}
+	for (; line[i] != '\0'; i++) {
+		if (strchr(" \t\r\n", line[i]) == NULL) {
+			return -1;
+		}
+	}
+   return 0;
+}
+
+// The message writers copy the 8-byte blocks out of the list into a buffer
+// and hand it to the file LIST_CHUNK bytes at a time, instead of making
+// one fwrite call per block. The list nodes are 24 bytes apart, so there's
+// no writing straight out of them.
+
+// Write the blocks of list to fp. If unpad is set, the list is a decrypted
+// message, and its last block only gives the real bytes that its last byte
+// counts (see pad_last_block): the padding comes off as the data goes out,
+// with no second pass. Returns the number of bytes written, -1 if a write
+// failed, or -2 if the padding doesn't make sense (wrong key or mode, or
+// damaged); everything before the last block has been written by then.
+long write_block_list(FILE *fp, BLOCKLIST list, int unpad) {
+	unsigned char *buf = malloc(LIST_CHUNK);
+	size_t fill = 0;
+	long total = 0;
+	if (buf == NULL || fp == NULL) {
+		free(buf);
+		return -1;
+	}
+	uint64_t t = trace_begin();
+	for (; list != NULL; list = list->next) {
+		size_t len = 8;
+		if (unpad && list->next == NULL) {
+			uint64_t tp = trace_begin();
+			len = ((unsigned char *) &list->block)[7];
+			if (len > 7) {
+				total = -2;
+				break;
+			}
+			trace_end("pad", tp, 8 - len);
+		}
+		memcpy(buf + fill, &list->block, len);
+		fill += len;
+		if (fill + 8 > LIST_CHUNK) {
+			if (fwrite(buf, 1, fill, fp) != fill) {
+				total = -1;
+				break;
+			}
+			trace_end("write", t, fill);
+			t = trace_begin();
+			total += fill;
+			fill = 0;
+		}
+	}
+	if (total >= 0 && fill > 0) {
+		total = fwrite(buf, 1, fill, fp) == fill ? total + (long) fill : -1;
+		trace_end("write", t, fill);
+	}
+	free(buf);
+	return total;
+}
+
+// Write the encrypted blocks to file. The encrypted file is in binary, i.e., you can
+// just write each 64-bit block directly to the file, without any conversion.
+int write_encrypted_message(FILE *msg_fp, BLOCKLIST msg) {
+	if (msg != NULL && write_block_list(msg_fp, msg, 0) < 0) {
+		fprintf(stderr, "Can't write the output file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// Write the encrypted blocks to file. This is called by the decryption routine.
+// The output file is a plain ASCII file, containing the decrypted text message.
+// Returns 0, or 1 if there's no message (the input was empty or not whole
+// blocks), its padding is wrong, or the file couldn't be written.
+int write_decrypted_message(FILE *msg_fp, BLOCKLIST msg) {
+	if (msg == NULL) {
+		fprintf(stderr, "Decryption failed: the encrypted message is missing or isn't whole blocks.\n");
+		return 1;
+	}
+	long n = write_block_list(msg_fp, msg, 1);
+	if (n == -2) {
+		fprintf(stderr, "Decryption failed: the message was damaged or the key is wrong.\n");
+	} else if (n < 0) {
+		fprintf(stderr, "Can't write the output file.\n");
+	}
+	return n < 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Encryption
+/////////////////////////////////////////////////////////////////////////////
+
+/*
+	Performs the initial permutation step in encryption by moving bits according to the 
+	init_perm[] array. As in the standard, bit 1 is the most significant bit.
+*/
+BLOCKTYPE initPermute(BLOCKTYPE b){
+	BLOCKTYPE newBlock = 0;
+	for (int i=0; i<64; i++) {
+		newBlock = (newBlock << 1) | ((b >> (64 - init_perm[i])) & 1);
+	}
+	return newBlock;
+}
+
+/*
+	The inverse of initPermute, using the final_perm[] array.
+*/
+BLOCKTYPE finalPermute(BLOCKTYPE b){
+	BLOCKTYPE newBlock = 0;
+	for (int i=0; i<64; i++) {
+		newBlock = (newBlock << 1) | ((b >> (64 - final_perm[i])) & 1);
+	}
+	return newBlock;
+}
+
+/*
+	Applies the expansion box, similiar to permutation, moving around the bits, 
+	forming the 32 bit right into a 48 bit.
+*/
+
+BLOCKTYPE expand(BLOCKTYPE right) {
+	BLOCKTYPE newRight = 0;
+	int i;
+	for (i=0; i<48; i++) {
+		newRight = (newRight << 1) | ((right >> (32 - expand_box[i])) & 1);
+	}
+
+	return newRight;
+}
+
+/*
+	Applies the P-box to the 32 bits coming out of the S-boxes.
+*/
+BLOCKTYPE pboxPermute(BLOCKTYPE in) {
+	BLOCKTYPE out = 0;
+	int i;
+	for (i=0; i<32; i++) {
+		out = (out << 1) | ((in >> (32 - Pbox[i])) & 1);
+	}
+	return out;
+}
+
+uint64_t (*sboxes[8])[16] = { sbox_1, sbox_2, sbox_3, sbox_4, sbox_5, sbox_6, sbox_7, sbox_8 };
+
+// Looks up the 6 bits "six" in S-box number box (0-7). The outer two bits
+// pick the row, the middle four the column.
+BLOCKTYPE sbox_lookup(int box, int six) {
+	int row = ((six & 0x20) >> 4) | (six & 1);
+	int col = (six >> 1) & 0xf;
+	return sboxes[box][row][col];
+}
+
+BLOCKTYPE f_function(BLOCKTYPE right, BLOCKTYPE key) {
+//  1.expand right
+	right = expand(right);
+//	2.XOR the expanded R and the compressed key,
+	right = right ^ key;
+
+//	3.Send the result through 8 S-boxes using the S-Box
+//	Substitution to get 32 new bits,
+	BLOCKTYPE mask6Bit = 0x3f;
+	BLOCKTYPE sboxed = 0;
+	int i;
+	for (i=0; i<8; i++) {
+		sboxed = (sboxed << 4) | sbox_lookup(i, (right >> (42 - 6*i)) & mask6Bit);
+	}
+
+//	4. Permute the result using the P-Box Permutation
+	return pboxPermute(sboxed);
+}
+
+// The 16 rounds of the Feistel network, with the subkeys in the order given
+// by "first" and "step" (0, 1 to encrypt, 15, -1 to decrypt).
+BLOCKTYPE feistel(BLOCKTYPE v, int first, int step) {
+	//Step 1: Initially Permutate the block
+	v = initPermute(v);
+	//Step 2: Split the block into left and right
+	BLOCKTYPE left = v >> 32;
+	BLOCKTYPE right = v & 0xFFFFFFFF;
+	//Step 3: 16 rounds of encrypting
+	int i;
+	for (i=0; i<16; i++) {
+		BLOCKTYPE next = left ^ f_function(right, getSubKey(first + i*step));
+		left = right;
+		right = next;
+	}
+	//Step 4: swap the halves back and undo the initial permutation
+	return finalPermute((right << 32) | left);
+}
+
+// Encrypt one block. This is where the main computation takes place. It takes
+// one 64-bit block as input, and returns the encrypted 64-bit block. The
+// subkeys needed by the Feistel Network is given by the function getSubKey(i).
+// This bit-at-a-time version is the reference the faster engines are checked
+// against; bulk encryption goes through the table and SIMD engines below.
+BLOCKTYPE des_enc(BLOCKTYPE v){
+   return feistel(v, 0, 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Table engine
+/////////////////////////////////////////////////////////////////////////////
+
+// The usual fast software DES: the S-boxes and the P-box are merged into 8
+// tables of 64 32-bit words, and the initial/final permutations are done a
+// byte at a time with 8 tables of 256 entries each. One block has a chain of
+// 16 dependent rounds, which leaves most of the CPU idle, so the engine runs
+// 2, 4 or 8 independent blocks in lockstep and lets their rounds overlap.
+// table_interleave is the widest factor to use; it's picked by timing them
+// once at start-up.
+static uint32_t sp_table[8][64];
+static BLOCKTYPE ip_table[8][256];
+static BLOCKTYPE fp_table[8][256];
+static unsigned char enc_schedule[16][8];   // subkeys cut into 6-bit S-box inputs
+static unsigned char dec_schedule[16][8];
+static unsigned char cmac_schedule[16][8];  // the MAC key's, see des_cmac_load
+static BLOCKTYPE cmac_k1;
+static int cmac_loaded;                     // whether those two go with the key above
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+int table_interleave = 8;
+
+// Cut 16 subkeys into the 6-bit pieces the rounds use, in encryption and in
+// decryption order.
+void table_cut_subkeys(const uint64_t *subkeys, unsigned char (*enc)[8], unsigned char (*dec)[8]) {
+	int round, box;
+	for (round=0; round<16; round++) {
+		for (box=0; box<8; box++) {
+			unsigned char k = (subkeys[round] >> (42 - 6*box)) & 0x3f;
+			enc[round][box] = k;
+			dec[15 - round][box] = k;
+		}
+	}
+}
+
+// Cut the current subkeys (getSubKey) into the schedules the engine uses.
+void table_load_subkeys(void) {
+	uint64_t subkeys[16];
+	int round;
+	for (round=0; round<16; round++) {
+		subkeys[round] = getSubKey(round);
+	}
+	table_cut_subkeys(subkeys, enc_schedule, dec_schedule);
+	cmac_loaded = 0;
+}
+
+static void table_build(void) {
+	int box, six, pos, v;
+	for (box=0; box<8; box++) {
+		for (six=0; six<64; six++) {
+			sp_table[box][six] = (uint32_t) pboxPermute(sbox_lookup(box, six) << (28 - 4*box));
+		}
+	}
+	for (pos=0; pos<8; pos++) {
+		for (v=0; v<256; v++) {
+			ip_table[pos][v] = initPermute((BLOCKTYPE) v << (56 - 8*pos));
+			fp_table[pos][v] = finalPermute((BLOCKTYPE) v << (56 - 8*pos));
+		}
+	}
+	table_load_subkeys();
+}
+
+void table_init(void) {
+	pthread_once(&tables_once, table_build);
+}
+
+static inline BLOCKTYPE table_permute(BLOCKTYPE (*t)[256], BLOCKTYPE v) {
+	return t[0][v >> 56] ^ t[1][(v >> 48) & 0xff] ^ t[2][(v >> 40) & 0xff] ^ t[3][(v >> 32) & 0xff]
+		^ t[4][(v >> 24) & 0xff] ^ t[5][(v >> 16) & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[7][v & 0xff];
+}
+
+// f for one half block. r rotated right by one bit lines up each group of
+// 6 expanded bits at a multiple of 4, so E never has to be done bit by bit.
+static inline uint32_t table_f(uint32_t r, const unsigned char *k) {
+	uint32_t y = (r >> 1) | (r << 31);
+	return sp_table[0][((y >> 26) & 0x3f) ^ k[0]] | sp_table[1][((y >> 22) & 0x3f) ^ k[1]]
+		| sp_table[2][((y >> 18) & 0x3f) ^ k[2]] | sp_table[3][((y >> 14) & 0x3f) ^ k[3]]
+		| sp_table[4][((y >> 10) & 0x3f) ^ k[4]] | sp_table[5][((y >> 6) & 0x3f) ^ k[5]]
+		| sp_table[6][((y >> 2) & 0x3f) ^ k[6]] | sp_table[7][(((y & 0xf) << 2) | (y >> 30)) ^ k[7]];
+}
+
+// Run n (a constant after inlining) blocks through the rounds side by side.
+static inline __attribute__((always_inline))
+void table_rounds(BLOCKTYPE *blocks, int n, unsigned char (*schedule)[8]) {
+	uint32_t l[8], r[8];
+	int i, round;
+	for (i=0; i<n; i++) {
+		BLOCKTYPE v = table_permute(ip_table, blocks[i]);
+		l[i] = (uint32_t) (v >> 32);
+		r[i] = (uint32_t) v;
+	}
+	for (round=0; round<16; round++) {
+		for (i=0; i<n; i++) {
+			uint32_t next = l[i] ^ table_f(r[i], schedule[round]);
+			l[i] = r[i];
+			r[i] = next;
+		}
+	}
+	for (i=0; i<n; i++) {
+		blocks[i] = table_permute(fp_table, ((BLOCKTYPE) r[i] << 32) | l[i]);
+	}
+}
+
+static void table_x1(BLOCKTYPE *b, unsigned char (*s)[8]) { table_rounds(b, 1, s); }
+static void table_x2(BLOCKTYPE *b, unsigned char (*s)[8]) { table_rounds(b, 2, s); }
+static void table_x4(BLOCKTYPE *b, unsigned char (*s)[8]) { table_rounds(b, 4, s); }
+static void table_x8(BLOCKTYPE *b, unsigned char (*s)[8]) { table_rounds(b, 8, s); }
+
+// Encrypt (or decrypt) n blocks in place, widest interleave first.
+void table_crypt(BLOCKTYPE *blocks, size_t n, int decrypting) {
+	unsigned char (*s)[8] = decrypting ? dec_schedule : enc_schedule;
+	size_t i = 0;
+	table_init();
+	if (table_interleave >= 8) {
+		for (; i+8<=n; i+=8) {
+			table_x8(blocks + i, s);
+		}
+	}
+	if (table_interleave >= 4) {
+		for (; i+4<=n; i+=4) {
+			table_x4(blocks + i, s);
+		}
+	}
+	if (table_interleave >= 2) {
+		for (; i+2<=n; i+=2) {
+			table_x2(blocks + i, s);
+		}
+	}
+	for (; i<n; i++) {
+		table_x1(blocks + i, s);
+	}
+}
+
+// Like table_rounds, but every block has a schedule of its own, for when each
+// block is under a different key.
+static inline __attribute__((always_inline))
+void table_rounds_keys(BLOCKTYPE *blocks, int n, unsigned char (**schedules)[8]) {
+	uint32_t l[8], r[8];
+	int i, round;
+	for (i=0; i<n; i++) {
+		BLOCKTYPE v = table_permute(ip_table, blocks[i]);
+		l[i] = (uint32_t) (v >> 32);
+		r[i] = (uint32_t) v;
+	}
+	for (round=0; round<16; round++) {
+		for (i=0; i<n; i++) {
+			uint32_t next = l[i] ^ table_f(r[i], schedules[i][round]);
+			l[i] = r[i];
+			r[i] = next;
+		}
+	}
+	for (i=0; i<n; i++) {
+		blocks[i] = table_permute(fp_table, ((BLOCKTYPE) r[i] << 32) | l[i]);
+	}
+}
+
+// Run block i through schedules[i], for n blocks, 8 at a time.
+void table_crypt_keys(BLOCKTYPE *blocks, size_t n, unsigned char (**schedules)[8]) {
+	size_t i = 0;
+	table_init();
+	for (; i+8<=n; i+=8) {
+		table_rounds_keys(blocks + i, 8, schedules + i);
+	}
+	for (; i<n; i++) {
+		table_rounds_keys(blocks + i, 1, schedules + i);
+	}
+}
+
+// Time each interleave factor on a small batch and keep the fastest. Takes a
+// millisecond or so.
+void table_calibrate(void) {
+	BLOCKTYPE blocks[512];
+	int factors[] = { 1, 2, 4, 8 };
+	double best = 0;
+	int f, i, rep;
+	table_init();
+	for (i=0; i<512; i++) {
+		blocks[i] = i;
+	}
+	for (f=0; f<4; f++) {
+		table_interleave = factors[f];
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (rep=0; rep<4; rep++) {
+			table_crypt(blocks, 512, 0);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		double t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+		if (f == 0 || t < best) {
+			best = t;
+			factors[0] = factors[f];
+		}
+	}
+	table_interleave = factors[0];
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// SIMD engine
+/////////////////////////////////////////////////////////////////////////////
+
+// The S-boxes only have 4-bit outputs, so they fit the byte shuffle
+// instructions: pshufb looks up 32 bytes at once in a 16-entry table, and
+// AVX-512 VBMI's vpermb does 64 lookups in a 64-entry one. The blocks are
+// kept "byte sliced": vector b holds byte b of the half block of 32 (or 64)
+// different blocks, so E is a few byte shifts and each S-box is looked up for
+// every block with a handful of instructions. Unlike a bitsliced engine a
+// batch is only 32 or 64 blocks, so it pays off at moderate sizes too.
+// IP and FP stay in the table engine's scalar code.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DES_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define SIMD_NONE 0
+#define SIMD_AVX2 1
+#define SIMD_VBMI 2
+
+int simd_engine = SIMD_NONE;   // picked by simd_init, 0 means use the table engine
+
+#ifdef DES_SIMD
+// vs_table[box][row] is 16 outputs of the box, for six-bit inputs row*16+i.
+// vp_table[box][b] is byte b of the P-box applied to each 4-bit output of box.
+// vsp_table[box][b] does both at once for vpermb, indexed by the six bits.
+static unsigned char vs_table[8][4][16] __attribute__((aligned(64)));
+static unsigned char vp_table[8][4][16] __attribute__((aligned(64)));
+static unsigned char vsp_table[8][4][64] __attribute__((aligned(64)));
+static unsigned char lane_regroup[64] __attribute__((aligned(64)));   // see simd_lane_keys
+
+static void simd_build(void) {
+	int box, b, i;
+	for (i=0; i<64; i++) {
+		lane_regroup[i] = 8 * (i % 8) + i / 8;      // byte j of qword b <- byte b of qword j
+	}
+	for (box=0; box<8; box++) {
+		for (i=0; i<64; i++) {
+			vs_table[box][i >> 4][i & 0xf] = sbox_lookup(box, i);
+			for (b=0; b<4; b++) {
+				vsp_table[box][b][i] = sp_table[box][i] >> (24 - 8*b);
+			}
+		}
+		for (i=0; i<16; i++) {
+			uint32_t p = (uint32_t) pboxPermute((BLOCKTYPE) i << (28 - 4*box));
+			for (b=0; b<4; b++) {
+				vp_table[box][b][i] = p >> (24 - 8*b);
+			}
+		}
+	}
+}
+
+// IP each block and spread the halves into the byte sliced arrays.
+static inline void simd_load(const BLOCKTYPE *blocks, int n, unsigned char (*l)[64], unsigned char (*r)[64]) {
+	int i, b;
+	for (i=0; i<n; i++) {
+		BLOCKTYPE v = table_permute(ip_table, blocks[i]);
+		for (b=0; b<4; b++) {
+			l[b][i] = v >> (56 - 8*b);
+			r[b][i] = v >> (24 - 8*b);
+		}
+	}
+}
+
+// Gather the halves back, swapped, and undo IP.
+static inline void simd_store(BLOCKTYPE *blocks, int n, unsigned char (*l)[64], unsigned char (*r)[64]) {
+	int i, b;
+	for (i=0; i<n; i++) {
+		BLOCKTYPE v = 0;
+		for (b=0; b<4; b++) {
+			v |= ((BLOCKTYPE) r[b][i] << (56 - 8*b)) | ((BLOCKTYPE) l[b][i] << (24 - 8*b));
+		}
+		blocks[i] = table_permute(fp_table, v);
+	}
+}
+
+// Byte-wise shifts; x86 only shifts 16-bit lanes, so mask off what crossed over.
+#define SHR8_256(x, n) _mm256_and_si256(_mm256_srli_epi16(x, n), _mm256_set1_epi8(0xff >> (n)))
+#define SHL8_256(x, n) _mm256_and_si256(_mm256_slli_epi16(x, n), _mm256_set1_epi8((0xff << (n)) & 0xff))
+
+// The AVX2 engine's simd_lane_keys, for 32 lanes: byte i of keys[round][box]
+// gets lanes[i][round][box]. AVX2 can't shuffle bytes across its two halves,
+// so each round of each 8 lanes is transposed on its own in 16 bytes, by
+// interleaving the lanes' bytes, then pairs of them, then fours.
+__attribute__((target("avx2")))
+static inline void simd_lane_keys_avx2(unsigned char (**lanes)[8], unsigned char (*keys)[8][32]) {
+	__m128i q[8], t[4], u[4], v[4];
+	int g, i, round;
+	for (round=0; round<16; round++) {
+		for (g=0; g<32; g+=8) {
+			for (i=0; i<8; i++) {
+				q[i] = _mm_loadl_epi64((const __m128i *) lanes[g + i][round]);
+			}
+			for (i=0; i<4; i++) {
+				t[i] = _mm_unpacklo_epi8(q[2*i], q[2*i + 1]);
+			}
+			u[0] = _mm_unpacklo_epi16(t[0], t[1]);      // boxes 0-3 of lanes 0-3
+			u[1] = _mm_unpackhi_epi16(t[0], t[1]);      // boxes 4-7
+			u[2] = _mm_unpacklo_epi16(t[2], t[3]);      // the same for lanes 4-7
+			u[3] = _mm_unpackhi_epi16(t[2], t[3]);
+			v[0] = _mm_unpacklo_epi32(u[0], u[2]);      // boxes 0 and 1 of all 8
+			v[1] = _mm_unpackhi_epi32(u[0], u[2]);
+			v[2] = _mm_unpacklo_epi32(u[1], u[3]);
+			v[3] = _mm_unpackhi_epi32(u[1], u[3]);
+			for (i=0; i<4; i++) {
+				_mm_storel_epi64((__m128i *) &keys[round][2*i][g], v[i]);
+				_mm_storeh_pd((double *) &keys[round][2*i + 1][g], _mm_castsi128_pd(v[i]));
+			}
+		}
+	}
+}
+
+// 32 blocks with AVX2. Each S-box is four pshufb over its four rows, and two
+// rounds of blends on bits 4 and 5 of the input pick the right row; then four
+// more pshufb spread the output over the P-box's bytes. All the blocks use
+// "schedule", or, if lanes isn't NULL, block i uses lanes[i].
+__attribute__((target("avx2")))
+static void simd_avx2(BLOCKTYPE *blocks, unsigned char (*schedule)[8], unsigned char (**lanes)[8]) {
+	unsigned char l[4][64] __attribute__((aligned(32)));
+	unsigned char r[4][64] __attribute__((aligned(32)));
+	unsigned char keys[16][8][32] __attribute__((aligned(32)));
+	__m256i L[4], R[4], s[8][4], p[8][4];
+	const __m256i one = _mm256_set1_epi8(1), low5 = _mm256_set1_epi8(0x1f);
+	int round, box, b;
+	if (lanes != NULL) {
+		simd_lane_keys_avx2(lanes, keys);
+	}
+	simd_load(blocks, 32, l, r);
+	for (b=0; b<4; b++) {
+		L[b] = _mm256_load_si256((const __m256i *) l[b]);
+		R[b] = _mm256_load_si256((const __m256i *) r[b]);
+	}
+	for (box=0; box<8; box++) {
+		for (b=0; b<4; b++) {
+			s[box][b] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) vs_table[box][b]));
+			p[box][b] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) vp_table[box][b]));
+		}
+	}
+	for (round=0; round<16; round++) {
+		__m256i in[8], f[4];
+		// E: each 6-bit group takes the low bits of one byte and the top of the next
+		in[0] = _mm256_or_si256(SHL8_256(_mm256_and_si256(R[3], one), 5), SHR8_256(R[0], 3));
+		in[1] = _mm256_or_si256(SHL8_256(_mm256_and_si256(R[0], low5), 1), SHR8_256(R[1], 7));
+		in[2] = _mm256_or_si256(SHL8_256(_mm256_and_si256(R[0], one), 5), SHR8_256(R[1], 3));
+		in[3] = _mm256_or_si256(SHL8_256(_mm256_and_si256(R[1], low5), 1), SHR8_256(R[2], 7));
+		in[4] = _mm256_or_si256(SHL8_256(_mm256_and_si256(R[1], one), 5), SHR8_256(R[2], 3));
+		in[5] = _mm256_or_si256(SHL8_256(_mm256_and_si256(R[2], low5), 1), SHR8_256(R[3], 7));
+		in[6] = _mm256_or_si256(SHL8_256(_mm256_and_si256(R[2], one), 5), SHR8_256(R[3], 3));
+		in[7] = _mm256_or_si256(SHL8_256(_mm256_and_si256(R[3], low5), 1), SHR8_256(R[0], 7));
+		for (b=0; b<4; b++) {
+			f[b] = L[b];
+		}
+		for (box=0; box<8; box++) {
+			__m256i k = lanes != NULL ? _mm256_load_si256((const __m256i *) keys[round][box])
+					: _mm256_set1_epi8(schedule[round][box]);
+			__m256i x = _mm256_xor_si256(in[box], k);
+			__m256i bit4 = _mm256_slli_epi16(x, 3), bit5 = _mm256_slli_epi16(x, 2);
+			__m256i lo = _mm256_blendv_epi8(_mm256_shuffle_epi8(s[box][0], x), _mm256_shuffle_epi8(s[box][1], x), bit4);
+			__m256i hi = _mm256_blendv_epi8(_mm256_shuffle_epi8(s[box][2], x), _mm256_shuffle_epi8(s[box][3], x), bit4);
+			__m256i out = _mm256_blendv_epi8(lo, hi, bit5);
+			for (b=0; b<4; b++) {
+				f[b] = _mm256_xor_si256(f[b], _mm256_shuffle_epi8(p[box][b], out));
+			}
+		}
+		for (b=0; b<4; b++) {
+			L[b] = R[b];
+			R[b] = f[b];
+		}
+	}
+	for (b=0; b<4; b++) {
+		_mm256_store_si256((__m256i *) l[b], L[b]);
+		_mm256_store_si256((__m256i *) r[b], R[b]);
+	}
+	simd_store(blocks, 32, l, r);
+}
+
+#define SHR8_512(x, n) _mm512_and_si512(_mm512_srli_epi16(x, n), _mm512_set1_epi8(0xff >> (n)))
+#define SHL8_512(x, n) _mm512_and_si512(_mm512_slli_epi16(x, n), _mm512_set1_epi8((0xff << (n)) & 0xff))
+
+// Transpose 8x8 qwords: afterwards qword j of x[i] is what qword i of x[j]
+// was. Three rounds of swapping blocks of 4, 2 and 1 qwords between pairs.
+#define SIMD_SWAP(d, ilo, ihi) \
+	for (i=0; i<8; i++) { \
+		if (!(i & d)) { \
+			__m512i a = x[i], b = x[i + d]; \
+			x[i] = _mm512_permutex2var_epi64(a, ilo, b); \
+			x[i + d] = _mm512_permutex2var_epi64(a, ihi, b); \
+		} \
+	}
+
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) void simd_transpose8(__m512i x[8]) {
+	int i;
+	SIMD_SWAP(4, _mm512_set_epi64(11, 10, 9, 8, 3, 2, 1, 0), _mm512_set_epi64(15, 14, 13, 12, 7, 6, 5, 4));
+	SIMD_SWAP(2, _mm512_set_epi64(13, 12, 5, 4, 9, 8, 1, 0), _mm512_set_epi64(15, 14, 7, 6, 11, 10, 3, 2));
+	SIMD_SWAP(1, _mm512_set_epi64(14, 6, 12, 4, 10, 2, 8, 0), _mm512_set_epi64(15, 7, 13, 5, 11, 3, 9, 1));
+}
+
+// Each lane (block) has a schedule of its own: byte i of k[round][box] gets
+// lanes[i][round][box]. That's a transpose of 64 schedules of 128 bytes, done
+// once per batch before the rounds, with shuffles only: 8 lanes' schedules
+// are loaded 8 rounds at a time and transposed so that each register holds
+// one round of the 8 lanes, its bytes are regrouped by box, and then each
+// round's registers of the 8 groups of lanes are transposed again.
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static inline void simd_lane_keys(unsigned char (**lanes)[8], __m512i k[16][8]) {
+	const __m512i regroup = _mm512_load_si512(lane_regroup);
+	__m512i x[8];
+	int g, h, i, round;
+	for (g=0; g<8; g++) {
+		for (h=0; h<16; h+=8) {
+			for (i=0; i<8; i++) {
+				x[i] = _mm512_loadu_si512(lanes[8*g + i][h]);
+			}
+			simd_transpose8(x);
+			for (i=0; i<8; i++) {
+				k[h + i][g] = _mm512_permutexvar_epi8(regroup, x[i]);
+			}
+		}
+	}
+	for (round=0; round<16; round++) {
+		simd_transpose8(k[round]);
+	}
+}
+
+// 64 blocks with AVX-512 VBMI. vpermb takes a 6-bit index, so the S-box and
+// the P-box come out of one lookup per output byte, with no blends. All the
+// blocks use "schedule", or, if lanes isn't NULL, block i uses lanes[i].
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void simd_vbmi(BLOCKTYPE *blocks, unsigned char (*schedule)[8], unsigned char (**lanes)[8]) {
+	unsigned char l[4][64] __attribute__((aligned(64)));
+	unsigned char r[4][64] __attribute__((aligned(64)));
+	__m512i L[4], R[4], sp[8][4], keys[16][8];
+	const __m512i one = _mm512_set1_epi8(1), low5 = _mm512_set1_epi8(0x1f);
+	int round, box, b;
+	if (lanes != NULL) {
+		simd_lane_keys(lanes, keys);
+	}
+	simd_load(blocks, 64, l, r);
+	for (b=0; b<4; b++) {
+		L[b] = _mm512_load_si512(l[b]);
+		R[b] = _mm512_load_si512(r[b]);
+	}
+	for (box=0; box<8; box++) {
+		for (b=0; b<4; b++) {
+			sp[box][b] = _mm512_load_si512(vsp_table[box][b]);
+		}
+	}
+	for (round=0; round<16; round++) {
+		__m512i in[8], f[4], k[8];
+		for (box=0; box<8; box++) {
+			k[box] = lanes != NULL ? keys[round][box] : _mm512_set1_epi8(schedule[round][box]);
+		}
+		in[0] = _mm512_or_si512(SHL8_512(_mm512_and_si512(R[3], one), 5), SHR8_512(R[0], 3));
+		in[1] = _mm512_or_si512(SHL8_512(_mm512_and_si512(R[0], low5), 1), SHR8_512(R[1], 7));
+		in[2] = _mm512_or_si512(SHL8_512(_mm512_and_si512(R[0], one), 5), SHR8_512(R[1], 3));
+		in[3] = _mm512_or_si512(SHL8_512(_mm512_and_si512(R[1], low5), 1), SHR8_512(R[2], 7));
+		in[4] = _mm512_or_si512(SHL8_512(_mm512_and_si512(R[1], one), 5), SHR8_512(R[2], 3));
+		in[5] = _mm512_or_si512(SHL8_512(_mm512_and_si512(R[2], low5), 1), SHR8_512(R[3], 7));
+		in[6] = _mm512_or_si512(SHL8_512(_mm512_and_si512(R[2], one), 5), SHR8_512(R[3], 3));
+		in[7] = _mm512_or_si512(SHL8_512(_mm512_and_si512(R[3], low5), 1), SHR8_512(R[0], 7));
+		for (b=0; b<4; b++) {
+			f[b] = L[b];
+		}
+		for (box=0; box<8; box++) {
+			__m512i x = _mm512_xor_si512(in[box], k[box]);
+			for (b=0; b<4; b++) {
+				f[b] = _mm512_xor_si512(f[b], _mm512_permutexvar_epi8(x, sp[box][b]));
+			}
+		}
+		for (b=0; b<4; b++) {
+			L[b] = R[b];
+			R[b] = f[b];
+		}
+	}
+	for (b=0; b<4; b++) {
+		_mm512_store_si512(l[b], L[b]);
+		_mm512_store_si512(r[b], R[b]);
+	}
+	simd_store(blocks, 64, l, r);
+}
+#endif
+
+// Pick the widest SIMD engine the CPU has. Call after table_init.
+void simd_init(void) {
+#ifdef DES_SIMD
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, simd_build);
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512vbmi")) {
+		simd_engine = SIMD_VBMI;
+	} else if (__builtin_cpu_supports("avx2")) {
+		simd_engine = SIMD_AVX2;
+	}
+#endif
+}
+
+// The fastest engine depends on the host and on how much there is to do at
+// once (the wide vector units can slow the clock down, which doesn't pay off
+// for short messages on every CPU), so the tuner picks a SIMD level for each
+// class of message sizes. engine_for says which to use for a message.
+#define SIZE_CLASSES 3
+static const size_t size_class_limit[SIZE_CLASSES] = { 4 << 10, 1 << 20, (size_t) -1 };
+int class_engine[SIZE_CLASSES] = { SIMD_VBMI, SIMD_VBMI, SIMD_VBMI };
+
+int size_class(size_t bytes) {
+	int c = 0;
+	while (c < SIZE_CLASSES - 1 && bytes >= size_class_limit[c]) {
+		c++;
+	}
+	return c;
+}
+
+int engine_for(size_t bytes) {
+	return class_engine[size_class(bytes)];
+}
+
+// Encrypt (or decrypt) n blocks in place: whole batches on the SIMD engine
+// (no wider than "level" or than the CPU has), the rest on the table engine.
+void simd_crypt_level(BLOCKTYPE *blocks, size_t n, int decrypting, int level) {
+	size_t i = 0;
+	table_init();
+#ifdef DES_SIMD
+	unsigned char (*s)[8] = decrypting ? dec_schedule : enc_schedule;
+	if (level > simd_engine) {
+		level = simd_engine;
+	}
+	if (level == SIMD_VBMI) {
+		for (; i+64<=n; i+=64) {
+			simd_vbmi(blocks + i, s, NULL);
+		}
+	}
+	if (level >= SIMD_AVX2) {
+		for (; i+32<=n; i+=32) {
+			simd_avx2(blocks + i, s, NULL);
+		}
+	}
+#endif
+	table_crypt(blocks + i, n - i, decrypting);
+}
+
+// out[i] = des_enc(ctr + i) for n blocks: the CTR keystream.
+void simd_keystream_level(BLOCKTYPE *out, BLOCKTYPE ctr, size_t n, int level) {
+	size_t i;
+	for (i=0; i<n; i++) {
+		out[i] = ctr + i;
+	}
+	simd_crypt_level(out, n, 0, level);
+}
+
+// The same on the engine the tuner picked for a message of "bytes" bytes in
+// all (not just the n blocks of this call); (size_t) -1 for a stream of no
+// known length.
+void simd_crypt(BLOCKTYPE *blocks, size_t n, int decrypting, size_t bytes) {
+	simd_crypt_level(blocks, n, decrypting, engine_for(bytes));
+}
+
+void simd_keystream(BLOCKTYPE *out, BLOCKTYPE ctr, size_t n, size_t bytes) {
+	simd_keystream_level(out, ctr, n, engine_for(bytes));
+}
+
+// Run block i through schedules[i], for n blocks: full batches of 64 on the
+// VBMI engine and of 32 on the AVX2 engine (no wider than "level" or than the
+// CPU has), which give each lane its own key (or, if the whole batch is under
+// one key, skip sorting out the lanes' keys); the rest on the table engine.
+void simd_crypt_lanes_level(BLOCKTYPE *blocks, size_t n, unsigned char (**schedules)[8], int level) {
+	size_t i = 0;
+#ifdef DES_SIMD
+	if (level > simd_engine) {
+		level = simd_engine;
+	}
+	if (level == SIMD_VBMI) {
+		for (; i+64<=n; i+=64) {
+			int j = 1;
+			while (j < 64 && schedules[i + j] == schedules[i]) {
+				j++;
+			}
+			simd_vbmi(blocks + i, schedules[i], j == 64 ? NULL : schedules + i);
+		}
+	}
+	if (level >= SIMD_AVX2) {
+		for (; i+32<=n; i+=32) {
+			int j = 1;
+			while (j < 32 && schedules[i + j] == schedules[i]) {
+				j++;
+			}
+			simd_avx2(blocks + i, schedules[i], j == 32 ? NULL : schedules + i);
+		}
+	}
+#endif
+	table_crypt_keys(blocks + i, n - i, schedules + i);
+}
+
+void simd_crypt_lanes(BLOCKTYPE *blocks, size_t n, unsigned char (**schedules)[8]) {
+	simd_crypt_lanes_level(blocks, n, schedules, simd_engine);
+}
+
+// Bytes in a list of blocks, which picks the engine for it.
+size_t list_bytes(BLOCKLIST msg) {
+	size_t n = 0;
+	for (; msg != NULL; msg = msg->next) {
+		n += 8;
+	}
+	return n;
+}
+
+// Encrypt the blocks in ECB mode. The blocks have already been padded 
+// by the input routine. The output is an encrypted list of blocks.
+// The blocks are gathered 64 at a time so the SIMD engine gets whole batches.
+BLOCKLIST des_crypt_list(BLOCKLIST msg, int decrypting) {
+	BLOCKLIST walker = msg;
+	BLOCKLIST nodes[64];
+	BLOCKTYPE blocks[64];
+	size_t bytes = list_bytes(msg), traced = 0;
+	uint64_t t = trace_begin();
+	while (walker != NULL) {
+		int n = 0, i;
+		for (; walker != NULL && n < 64; walker = walker->next) {
+			nodes[n] = walker;
+			blocks[n++] = walker->block;
+		}
+		simd_crypt(blocks, n, decrypting, bytes);
+		for (i=0; i<n; i++) {
+			nodes[i]->block = blocks[i];
+		}
+		traced += 8*n;
+		if (traced >= LIST_CHUNK || walker == NULL) {
+			trace_end("cipher", t, traced);
+			t = trace_begin();
+			traced = 0;
+		}
+	}
+   return msg;
+}
+
+BLOCKLIST des_enc_ECB(BLOCKLIST msg) {
+   return des_crypt_list(msg, 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// CTR keystream cache
+/////////////////////////////////////////////////////////////////////////////
+
+// In Counter mode the keystream block for counter i is just des_enc(i), it
+// doesn't depend on the message at all. A KEYSTREAM starts some threads that
+// encrypt counters ahead of time into a bounded ring, so that encrypting a
+// block turns into an XOR with a block that's (hopefully) already there.
+// The ring is cut into segments of KS_SEGMENT blocks. A generator claims a
+// whole segment at a time, so the lock is only taken once per segment.
+#define KS_SEGMENT 256
+
+struct KEYSTREAM {
+	BLOCKTYPE *ring;        // nsegs*KS_SEGMENT precomputed keystream blocks
+	uint64_t *ready;        // for each slot, the segment number stored in it (or -1)
+	size_t nsegs;           // number of segments in the ring
+	BLOCKTYPE first;        // counter value of the very first keystream block
+	uint64_t next_seg;      // next segment a generator will claim
+	uint64_t read_seg;      // segment the consumer is reading from
+	size_t read_pos;        // position of the consumer inside read_seg
+	uint64_t generated;     // number of segments finished by the generators
+	int stop;               // set when the generators should exit
+	pthread_mutex_t lock;
+	pthread_cond_t filled;  // signalled when a segment is finished
+	pthread_cond_t drained; // signalled when the consumer frees a segment
+	pthread_t *threads;
+	int nthreads;
+	uint64_t stalls;        // times the consumer had to wait for a generator
+	uint64_t full;          // times a generator had to wait for the consumer
+	uint64_t max_ahead;     // most blocks ever generated ahead of the consumer
+};
+
+struct KEYSTREAM_STATS {
+	uint64_t consumed;      // keystream blocks handed out so far
+	uint64_t ahead;         // blocks currently generated but not consumed
+	uint64_t max_ahead;
+	uint64_t stalls;
+	uint64_t full;
+};
+
+// Generator thread. Claim the next segment as soon as its slot in the ring
+// has been consumed, fill it with des_enc(counter) and publish it.
+static void *keystream_worker(void *arg) {
+	static int workers = 0;
+	struct KEYSTREAM *ks = arg;
+	trace_name_thread("keystream", __sync_fetch_and_add(&workers, 1));
+	for (;;) {
+		pthread_mutex_lock(&ks->lock);
+		while (!ks->stop && ks->next_seg >= ks->read_seg + ks->nsegs) {
+			ks->full++;
+			pthread_cond_wait(&ks->drained, &ks->lock);
+		}
+		if (ks->stop) {
+			pthread_mutex_unlock(&ks->lock);
+			return NULL;
+		}
+		uint64_t seg = ks->next_seg++;
+		pthread_mutex_unlock(&ks->lock);
+
+		BLOCKTYPE *out = ks->ring + (seg % ks->nsegs) * KS_SEGMENT;
+		uint64_t t = trace_begin();
+		simd_keystream(out, ks->first + seg * KS_SEGMENT, KS_SEGMENT, (size_t) -1);
+		trace_end("keystream", t, 8 * KS_SEGMENT);
+
+		pthread_mutex_lock(&ks->lock);
+		ks->ready[seg % ks->nsegs] = seg;
+		ks->generated++;
+		uint64_t ahead = (ks->generated - ks->read_seg) * KS_SEGMENT - ks->read_pos;
+		if (ahead > ks->max_ahead) {
+			ks->max_ahead = ahead;
+		}
+		pthread_cond_broadcast(&ks->filled);
+		pthread_mutex_unlock(&ks->lock);
+	}
+}
+
+// Start generating keystream for the counters first, first+1, ... into a ring
+// of at least "blocks" blocks, using "nthreads" threads. If nthreads is 0, use
+// every core but one. Returns NULL if the ring or the threads can't be set up.
+struct KEYSTREAM *keystream_start(BLOCKTYPE first, size_t blocks, int nthreads) {
+	struct KEYSTREAM *ks = calloc(1, sizeof(struct KEYSTREAM));
+	if (ks == NULL) {
+		return NULL;
+	}
+	if (nthreads <= 0) {
+		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+		if (nthreads < 1) {
+			nthreads = 1;
+		}
+	}
+	ks->nsegs = (blocks + KS_SEGMENT - 1) / KS_SEGMENT;
+	if (ks->nsegs < 2) {
+		ks->nsegs = 2;
+	}
+	ks->first = first;
+	ks->ring = malloc(ks->nsegs * KS_SEGMENT * sizeof(BLOCKTYPE));
+	ks->ready = malloc(ks->nsegs * sizeof(uint64_t));
+	ks->threads = malloc(nthreads * sizeof(pthread_t));
+	if (ks->ring == NULL || ks->ready == NULL || ks->threads == NULL) {
+		free(ks->ring);
+		free(ks->ready);
+		free(ks->threads);
+		free(ks);
+		return NULL;
+	}
+	memset(ks->ready, 0xff, ks->nsegs * sizeof(uint64_t));
+	pthread_mutex_init(&ks->lock, NULL);
+	pthread_cond_init(&ks->filled, NULL);
+	pthread_cond_init(&ks->drained, NULL);
+	for (ks->nthreads=0; ks->nthreads<nthreads; ks->nthreads++) {
+		if (pthread_create(&ks->threads[ks->nthreads], NULL, keystream_worker, ks) != 0) {
+			break;
+		}
+	}
+	if (ks->nthreads == 0) {
+		pthread_mutex_destroy(&ks->lock);
+		pthread_cond_destroy(&ks->filled);
+		pthread_cond_destroy(&ks->drained);
+		free(ks->ring);
+		free(ks->ready);
+		free(ks->threads);
+		free(ks);
+		return NULL;
+	}
+	return ks;
+}
+
+// XOR the next n keystream blocks into blocks[0..n-1]. Only waits if the
+// generators haven't caught up with us yet, which is counted as a stall.
+void keystream_xor(struct KEYSTREAM *ks, BLOCKTYPE *blocks, size_t n) {
+	while (n > 0) {
+		size_t slot = ks->read_seg % ks->nsegs;
+		if (ks->read_pos == 0) {
+			pthread_mutex_lock(&ks->lock);
+			if (ks->ready[slot] != ks->read_seg) {
+				ks->stalls++;
+				while (ks->ready[slot] != ks->read_seg) {
+					pthread_cond_wait(&ks->filled, &ks->lock);
+				}
+			}
+			pthread_mutex_unlock(&ks->lock);
+		}
+		const BLOCKTYPE *in = ks->ring + slot * KS_SEGMENT + ks->read_pos;
+		size_t todo = KS_SEGMENT - ks->read_pos;
+		if (todo > n) {
+			todo = n;
+		}
+		size_t i;
+		for (i=0; i<todo; i++) {
+			blocks[i] ^= in[i];
+		}
+		blocks += todo;
+		n -= todo;
+		ks->read_pos += todo;
+		if (ks->read_pos == KS_SEGMENT) {
+			pthread_mutex_lock(&ks->lock);
+			ks->read_seg++;
+			ks->read_pos = 0;
+			pthread_cond_broadcast(&ks->drained);
+			pthread_mutex_unlock(&ks->lock);
+		}
+	}
+}
+
+void keystream_stats(struct KEYSTREAM *ks, struct KEYSTREAM_STATS *stats) {
+	pthread_mutex_lock(&ks->lock);
+	stats->consumed = ks->read_seg * KS_SEGMENT + ks->read_pos;
+	stats->ahead = (ks->generated - ks->read_seg) * KS_SEGMENT - ks->read_pos;
+	stats->max_ahead = ks->max_ahead;
+	stats->stalls = ks->stalls;
+	stats->full = ks->full;
+	pthread_mutex_unlock(&ks->lock);
+}
+
+// Stop the generators and free the ring.
+void keystream_stop(struct KEYSTREAM *ks) {
+	int i;
+	pthread_mutex_lock(&ks->lock);
+	ks->stop = 1;
+	pthread_cond_broadcast(&ks->drained);
+	pthread_mutex_unlock(&ks->lock);
+	for (i=0; i<ks->nthreads; i++) {
+		pthread_join(ks->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&ks->lock);
+	pthread_cond_destroy(&ks->filled);
+	pthread_cond_destroy(&ks->drained);
+	free(ks->ring);
+	free(ks->ready);
+	free(ks->threads);
+	free(ks);
+}
+
+// If set, des_enc_CTR/des_dec_CTR take their keystream from here instead of
+// calling des_enc themselves. It must have been started at counter 0.
+struct KEYSTREAM *ctr_keystream = NULL;
+
+// Same as des_enc_ECB, but encrypt the blocks in Counter mode.
+// SEE: https://en.wikipedia.org/wiki/Block_cipher_mode_of_operation#Counter_(CTR)
+// Start the counter at 0.
+BLOCKLIST des_enc_CTR(BLOCKLIST msg) {
+	BLOCKLIST walker = msg, first;
+	BLOCKTYPE counter = 0;
+	BLOCKTYPE ks[64];
+	size_t bytes = list_bytes(msg), traced = 0;
+	uint64_t t = trace_begin();
+	int i, n;
+	while (walker != NULL) {
+		// Take the keystream for the next 64 blocks in one go.
+		for (first=walker, n=0; walker != NULL && n < 64; walker=walker->next) {
+			ks[n++] = 0;
+		}
+		if (ctr_keystream != NULL) {
+			keystream_xor(ctr_keystream, ks, n);
+		} else {
+			simd_keystream(ks, counter, n, bytes);
+		}
+		for (walker=first, i=0; i<n; i++, walker=walker->next) {
+			walker->block ^= ks[i];
+		}
+		counter += n;
+		traced += 8*n;
+		if (traced >= LIST_CHUNK || walker == NULL) {
+			trace_end("cipher", t, traced);
+			t = trace_begin();
+			traced = 0;
+		}
+	}
+   return msg;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Decryption
+/////////////////////////////////////////////////////////////////////////////
+// Decrypt one block: the same rounds with the subkeys in reverse order.
+BLOCKTYPE des_dec(BLOCKTYPE v){
+   return feistel(v, 15, -1);
+}
+
+// Decrypt the blocks in ECB mode. The input is a list of encrypted blocks,
+// the output a list of plaintext blocks.
+BLOCKLIST des_dec_ECB(BLOCKLIST msg) {
+   return des_crypt_list(msg, 1);
+}
+
+// Decrypt the blocks in Counter mode. This is exactly the same operation as
+// encrypting, XOR with des_enc(counter).
+BLOCKLIST des_dec_CTR(BLOCKLIST msg) {
+   return des_enc_CTR(msg);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// In-place buffer encryption
+/////////////////////////////////////////////////////////////////////////////
+
+// The BLOCKLIST routines above allocate one node per block. These work on a
+// buffer the caller owns instead, and never allocate. The blocks in the buffer
+// are laid out exactly as write_encrypted_message writes them, 8 bytes each.
+// The modes, DES_ECB and DES_CTR, are in DES.h.
+
+typedef struct DESCTX {
+	int mode;                     // DES_ECB or DES_CTR
+	BLOCKTYPE counter;            // CTR: counter of the next block, start at 0
+	struct KEYSTREAM *keystream;  // CTR: optional precomputed keystream, or NULL
+	int mac;                      // append a CMAC tag when encrypting, check it when decrypting
+} DESCTX;
+
+void des_ctx_init(DESCTX *ctx, int mode) {
+	ctx->mode = mode;
+	ctx->counter = 0;
+	ctx->keystream = NULL;
+	ctx->mac = 0;
+}
+
+// Size of the CMAC tag appended to the ciphertext when ctx->mac is set.
+#define DES_TAG_SIZE 8
+
+// Number of bytes des_encrypt_inplace needs for a message of len bytes: the
+// padding rule of pad_last_block always adds between 1 and 8 bytes.
+size_t des_padded_length(size_t len) {
+	return (len / 8 + 1) * 8;
+}
+
+// Encrypt or decrypt n whole blocks in buf, without padding. In CTR mode the
+// counter in ctx is advanced, so a message can be processed in pieces.
+void des_crypt_blocks(DESCTX *ctx, unsigned char *buf, size_t n, int decrypting) {
+	BLOCKTYPE b;
+	size_t i;
+	uint64_t t = trace_begin();
+	BLOCKTYPE blocks[64];
+	if (ctx->mode == DES_CTR && ctx->keystream != NULL) {
+		for (i=0; i<n; i+=64) {
+			size_t todo = n - i < 64 ? n - i : 64;
+			memcpy(blocks, buf + 8*i, 8*todo);
+			keystream_xor(ctx->keystream, blocks, todo);
+			memcpy(buf + 8*i, blocks, 8*todo);
+		}
+		ctx->counter += n;
+		trace_end("cipher", t, 8*n);
+		return;
+	}
+	int level = engine_for(8*n);
+	for (i=0; i<n; i+=64) {
+		size_t todo = n - i < 64 ? n - i : 64, j;
+		if (ctx->mode == DES_CTR) {
+			simd_keystream_level(blocks, ctx->counter, todo, level);
+			ctx->counter += todo;
+			for (j=0; j<todo; j++) {
+				memcpy(&b, buf + 8*(i+j), 8);
+				b ^= blocks[j];
+				memcpy(buf + 8*(i+j), &b, 8);
+			}
+		} else {
+			memcpy(blocks, buf + 8*i, 8*todo);
+			simd_crypt_level(blocks, todo, decrypting, level);
+			memcpy(buf + 8*i, blocks, 8*todo);
+		}
+	}
+	trace_end("cipher", t, 8*n);
+}
+
+// CMAC (NIST SP 800-38B) over the ciphertext, with DES as the block cipher.
+// key.txt holds only one key, so the MAC gets a key of its own derived from
+// it: the top 56 bits of D_K(DES_MAC_LABEL). CTR mode only ever uses E_K,
+// so no keystream block is, or gives away, the MAC key or its CMAC subkey.
+#define DES_MAC_LABEL 0x3159454b2d43414dULL   // "MAC-KEY1"
+
+// Derive the MAC key's schedule and first CMAC subkey, once per key: the
+// first MAC'd message after table_load_subkeys does it, under a lock since
+// batch workers may get there together. The subkey is from L = E(0) under
+// the MAC key; our messages are always padded to whole blocks, so the second
+// one is never needed.
+static pthread_mutex_t cmac_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void des_cmac_load(void) {
+	if (__atomic_load_n(&cmac_loaded, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	pthread_mutex_lock(&cmac_lock);
+	if (!cmac_loaded) {
+		unsigned char dec[16][8];
+		uint64_t subkeys[16];
+		BLOCKTYPE k = DES_MAC_LABEL, l = 0;
+		table_crypt(&k, 1, 1);
+		key_schedule(k >> 8, subkeys);
+		table_cut_subkeys(subkeys, cmac_schedule, dec);
+		table_x1(&l, cmac_schedule);
+		cmac_k1 = (l << 1) ^ ((l >> 63) ? 0x1B : 0);
+		__atomic_store_n(&cmac_loaded, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&cmac_lock);
+}
+
+// 1 if the tags are the same. Doesn't branch on, or stop at, the bits that
+// differ, so the time taken says nothing about how close a forged tag was.
+int des_tag_equal(BLOCKTYPE a, BLOCKTYPE b) {
+	BLOCKTYPE d = a ^ b;
+	return (int) (((d | (0 - d)) >> 63) ^ 1);
+}
+
+// Encrypt or decrypt n whole blocks like des_crypt_blocks, and run the CMAC
+// over the ciphertext in the same pass, 64 blocks at a time while they're in
+// cache. The cipher and the CTR keystream go through the engines in bulk;
+// only the CMAC chain has to go one block after another. Returns the tag.
+BLOCKTYPE des_crypt_blocks_mac(DESCTX *ctx, unsigned char *buf, size_t n, int decrypting) {
+	BLOCKTYPE mac = 0, blocks[64], ks[64];
+	int level = engine_for(8*n);
+	size_t i, j;
+	uint64_t t = trace_begin();
+	des_cmac_load();
+	for (i=0; i<n; i+=64) {
+		size_t todo = n - i < 64 ? n - i : 64;
+		memcpy(blocks, buf + 8*i, 8*todo);
+		if (ctx->mode == DES_CTR) {
+			if (ctx->keystream != NULL) {
+				memset(ks, 0, 8*todo);
+				keystream_xor(ctx->keystream, ks, todo);
+			} else {
+				simd_keystream_level(ks, ctx->counter, todo, level);
+			}
+			ctx->counter += todo;
+		} else if (!decrypting) {
+			simd_crypt_level(blocks, todo, 0, level);
+		}
+		for (j=0; j<todo; j++) {
+			BLOCKTYPE in = blocks[j];
+			if (ctx->mode == DES_CTR) {
+				blocks[j] ^= ks[j];
+			}
+			mac ^= ctx->mode == DES_CTR && !decrypting ? blocks[j] : in;
+			if (i+j == n-1) {
+				mac ^= cmac_k1;
+			}
+			table_x1(&mac, cmac_schedule);
+		}
+		if (ctx->mode != DES_CTR && decrypting) {
+			simd_crypt_level(blocks, todo, 1, level);
+		}
+		memcpy(buf + 8*i, blocks, 8*todo);
+	}
+	trace_end("cipher", t, 8*n);
+	return mac;
+}
+
+// Pad the len bytes at the start of buf the way pad_last_block describes: the
+// last block is filled up with zeros and its last byte holds the number of real
+// bytes in it, a whole block of zeros is added when len is a multiple of 8.
+// buf must have room for des_padded_length(len) bytes, which is returned.
+size_t des_pad_inplace(unsigned char *buf, size_t len) {
+	uint64_t t = trace_begin();
+	size_t padded = des_padded_length(len);
+	memset(buf + len, 0, padded - len);
+	buf[padded - 1] = (unsigned char) (len % 8);
+	trace_end("pad", t, padded - len);
+	return padded;
+}
+
+// The reverse of des_pad_inplace: returns the number of real bytes in the len
+// (padded, decrypted) bytes in buf, or -1 if the padding doesn't make sense.
+long des_unpadded_length(const unsigned char *buf, size_t len) {
+	if (len == 0 || len % 8 != 0 || buf[len - 1] > 7) {
+		return -1;
+	}
+	return (long) (len - 8 + buf[len - 1]);
+}
+
+// Pad and encrypt the len bytes at the start of buf, in place. cap is the size
+// of buf. If ctx->mac is set, the CMAC tag is appended after the ciphertext,
+// which takes DES_TAG_SIZE more bytes. Returns the length of the ciphertext,
+// or -1 if it wouldn't fit in cap bytes.
+long des_encrypt_inplace(DESCTX *ctx, unsigned char *buf, size_t len, size_t cap) {
+	if (des_padded_length(len) + (ctx->mac ? DES_TAG_SIZE : 0) > cap) {
+		return -1;
+	}
+	size_t padded = des_pad_inplace(buf, len);
+	if (ctx->mac) {
+		BLOCKTYPE tag = des_crypt_blocks_mac(ctx, buf, padded / 8, 0);
+		memcpy(buf + padded, &tag, DES_TAG_SIZE);
+		return (long) (padded + DES_TAG_SIZE);
+	}
+	des_crypt_blocks(ctx, buf, padded / 8, 0);
+	return (long) padded;
+}
+
+// Decrypt the len bytes in buf, in place, and remove the padding. Returns the
+// length of the plaintext, or -1 if len isn't a whole number of blocks or the
+// padding byte doesn't make sense (wrong key or a damaged file). If ctx->mac
+// is set the last DES_TAG_SIZE bytes are the tag; if it doesn't match, the
+// buffer is wiped and -1 is returned. cap is accepted for symmetry with
+// des_encrypt_inplace; decrypting never grows the data.
+long des_decrypt_inplace(DESCTX *ctx, unsigned char *buf, size_t len, size_t cap) {
+	if (len == 0 || len % 8 != 0 || len > cap) {
+		return -1;
+	}
+	if (ctx->mac) {
+		BLOCKTYPE tag;
+		if (len < 8 + DES_TAG_SIZE) {
+			return -1;
+		}
+		len -= DES_TAG_SIZE;
+		memcpy(&tag, buf + len, DES_TAG_SIZE);
+		if (!des_tag_equal(des_crypt_blocks_mac(ctx, buf, len / 8, 1), tag)) {
+			memset(buf, 0, len);
+			return -1;
+		}
+		return des_unpadded_length(buf, len);
+	}
+	des_crypt_blocks(ctx, buf, len / 8, 1);
+	return des_unpadded_length(buf, len);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Small messages
+/////////////////////////////////////////////////////////////////////////////
+
+// Tokens of a few dozen bytes are dominated by everything around the cipher.
+// These take the message in and out of caller-owned memory, keep the blocks
+// in a stack array, and run them all through the table engine's rounds in
+// one interleaved pass with the subkey schedule that's already cut up. No
+// allocation, no locks, no batching.
+#define DES_SMALL_MAX 64                        // longest plaintext
+#define DES_SMALL_BLOCKS (DES_SMALL_MAX/8 + 1)  // its padded length in blocks
+
+// All n blocks side by side; n is at most DES_SMALL_BLOCKS.
+static void small_rounds(BLOCKTYPE *blocks, size_t n, unsigned char (*s)[8]) {
+	switch (n) {
+	case 1: table_rounds(blocks, 1, s); break;
+	case 2: table_rounds(blocks, 2, s); break;
+	case 3: table_rounds(blocks, 3, s); break;
+	case 4: table_rounds(blocks, 4, s); break;
+	case 5: table_rounds(blocks, 5, s); break;
+	case 6: table_rounds(blocks, 6, s); break;
+	case 7: table_rounds(blocks, 7, s); break;
+	case 8: table_rounds(blocks, 8, s); break;
+	case 9: table_rounds(blocks, 8, s); table_rounds(blocks + 8, 1, s); break;
+	}
+}
+
+static void small_crypt(DESCTX *ctx, BLOCKTYPE *blocks, size_t n, int decrypting) {
+	if (ctx->mode == DES_CTR) {
+		BLOCKTYPE ks[DES_SMALL_BLOCKS];
+		size_t i;
+		for (i=0; i<n; i++) {
+			ks[i] = ctx->counter + i;
+		}
+		small_rounds(ks, n, enc_schedule);
+		for (i=0; i<n; i++) {
+			blocks[i] ^= ks[i];
+		}
+		ctx->counter += n;
+	} else {
+		small_rounds(blocks, n, decrypting ? dec_schedule : enc_schedule);
+	}
+}
+
+// Pad and encrypt the len bytes at in into out, which needs room for
+// des_padded_length(len) bytes, plus DES_TAG_SIZE if ctx->mac is set.
+// Returns the length of the ciphertext, or -1 if len is over DES_SMALL_MAX.
+long des_encrypt_small(DESCTX *ctx, const unsigned char *in, size_t len, unsigned char *out) {
+	BLOCKTYPE blocks[DES_SMALL_BLOCKS];
+	if (len > DES_SMALL_MAX) {
+		return -1;
+	}
+	table_init();
+	memcpy(blocks, in, len);
+	size_t padded = des_pad_inplace((unsigned char *) blocks, len);
+	if (ctx->mac) {
+		BLOCKTYPE tag = des_crypt_blocks_mac(ctx, (unsigned char *) blocks, padded / 8, 0);
+		memcpy(out + padded, &tag, DES_TAG_SIZE);
+	} else {
+		small_crypt(ctx, blocks, padded / 8, 0);
+	}
+	memcpy(out, blocks, padded);
+	return (long) (padded + (ctx->mac ? DES_TAG_SIZE : 0));
+}
+
+// Decrypt the len bytes at in into out and remove the padding; out needs room
+// for len bytes. Returns the length of the plaintext, or -1 if the message is
+// too long for this path or damaged (see des_decrypt_inplace).
+long des_decrypt_small(DESCTX *ctx, const unsigned char *in, size_t len, unsigned char *out) {
+	BLOCKTYPE blocks[DES_SMALL_BLOCKS];
+	size_t tag = ctx->mac ? DES_TAG_SIZE : 0;
+	if (len < 8 + tag || len > 8*DES_SMALL_BLOCKS + tag || (len - tag) % 8 != 0) {
+		return -1;
+	}
+	table_init();
+	len -= tag;
+	memcpy(blocks, in, len);
+	if (ctx->mac) {
+		BLOCKTYPE expected;
+		memcpy(&expected, in + len, DES_TAG_SIZE);
+		if (!des_tag_equal(des_crypt_blocks_mac(ctx, (unsigned char *) blocks, len / 8, 1), expected)) {
+			return -1;
+		}
+	} else {
+		small_crypt(ctx, blocks, len / 8, 1);
+	}
+	long n = des_unpadded_length((unsigned char *) blocks, len);
+	if (n >= 0) {
+		memcpy(out, blocks, n);
+	}
+	return n;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Armor
+/////////////////////////////////////////////////////////////////////////////
+
+// "-armor hex" or "-armor base64" writes the ciphertext as text instead of
+// binary, and reads it back the same way when decrypting. The codecs use
+// AVX2 or SSSE3 byte shuffles when the CPU has them (checked once at run
+// time): the AVX2 kernels do two of the SSSE3 kernels' steps at once, one in
+// each 16-byte half, the SSSE3 ones take what's left after them, and plain
+// table lookups do the tail and serve other CPUs.
+#define ARMOR_NONE 0
+#define ARMOR_HEX 1
+#define ARMOR_BASE64 2
+
+static const char hex_digits[] = "0123456789abcdef";
+static const char base64_digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Value of one base64 digit, or -1.
+int base64_value(int c) {
+	if (c >= 'A' && c <= 'Z') {
+		return c - 'A';
+	} else if (c >= 'a' && c <= 'z') {
+		return c - 'a' + 26;
+	} else if (c >= '0' && c <= '9') {
+		return c - '0' + 52;
+	} else if (c == '+') {
+		return 62;
+	} else if (c == '/') {
+		return 63;
+	}
+	return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ARMOR_SIMD 1
+
+// 16 bytes -> 32 hex digits per step. Returns the number of input bytes done.
+__attribute__((target("ssse3")))
+static size_t hex_encode_ssse3(char *out, const unsigned char *in, size_t len) {
+	const __m128i lut = _mm_loadu_si128((const __m128i *) hex_digits);
+	const __m128i low = _mm_set1_epi8(0x0f);
+	size_t i;
+	for (i=0; i+16<=len; i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+		__m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), low));
+		__m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, low));
+		_mm_storeu_si128((__m128i *) (out + 2*i), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *) (out + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+	return i;
+}
+
+// Turn 16 hex digits into their values. *bad is set if any isn't a digit.
+__attribute__((target("ssse3")))
+static __m128i hex_values_ssse3(__m128i v, int *bad) {
+	__m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	__m128i l = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i is_l = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+	*bad |= _mm_movemask_epi8(_mm_or_si128(is_d, is_l)) != 0xffff;
+	return _mm_or_si128(_mm_and_si128(is_d, d),
+			_mm_and_si128(is_l, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+// 32 hex digits -> 16 bytes per step. Returns the number of digits done,
+// stopping early at a block with a bad digit so the scalar code reports it.
+__attribute__((target("ssse3")))
+static size_t hex_decode_ssse3(unsigned char *out, const char *in, size_t len) {
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	size_t i;
+	for (i=0; i+32<=len; i+=32) {
+		int bad = 0;
+		__m128i a = hex_values_ssse3(_mm_loadu_si128((const __m128i *) (in + i)), &bad);
+		__m128i b = hex_values_ssse3(_mm_loadu_si128((const __m128i *) (in + i + 16)), &bad);
+		if (bad) {
+			break;
+		}
+		a = _mm_maddubs_epi16(a, weights);
+		b = _mm_maddubs_epi16(b, weights);
+		_mm_storeu_si128((__m128i *) (out + i/2), _mm_packus_epi16(a, b));
+	}
+	return i;
+}
+
+// 12 bytes -> 16 base64 digits per step (reads 16 bytes, so stop 4 early).
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(char *out, const unsigned char *in, size_t len) {
+	const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'+' - 62, '/' - 63, 'A', 0, 0);
+	size_t i, o = 0;
+	for (i=0; i+16<=len; i+=12, o+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+		v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+		__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+				_mm_set1_epi32(0x04000040));
+		__m128i t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+				_mm_set1_epi32(0x01000010));
+		__m128i idx = _mm_or_si128(t0, t1);
+		__m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+		r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+		r = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, r), idx);
+		_mm_storeu_si128((__m128i *) (out + o), r);
+	}
+	return i;
+}
+
+// 16 base64 digits -> 12 bytes per step. Writes 16 bytes, which is fine when
+// decoding in place front to back. Returns the number of digits done,
+// stopping at the first block that has anything but digits (such as '=').
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(unsigned char *out, const char *in, size_t len) {
+	const __m128i shift_lut = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_lut = _mm_setr_epi8((char) 0xa8, (char) 0xf8, (char) 0xf8,
+			(char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8,
+			(char) 0xf8, (char) 0xf8, (char) 0xf0, 0x54, 0x50, 0x50, 0x50, 0x54);
+	const __m128i bit_lut = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40,
+			(char) 0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+	size_t i, o = 0;
+	for (i=0; i+16<=len; i+=16, o+=12) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi8(0x0f));
+		__m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+		__m128i ok = _mm_and_si128(_mm_shuffle_epi8(mask_lut, lo), _mm_shuffle_epi8(bit_lut, hi));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(ok, _mm_setzero_si128())) != 0) {
+			break;
+		}
+		__m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+		__m128i shift = _mm_or_si128(_mm_andnot_si128(slash, _mm_shuffle_epi8(shift_lut, hi)),
+				_mm_and_si128(slash, _mm_set1_epi8(16)));
+		v = _mm_add_epi8(v, shift);
+		v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+		v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+		v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		_mm_storeu_si128((__m128i *) (out + o), v);
+	}
+	return i;
+}
+
+// 32 bytes -> 64 hex digits per step. The unpacks work within each half, so
+// the halves are put back in order before storing.
+__attribute__((target("avx2")))
+static size_t hex_encode_avx2(char *out, const unsigned char *in, size_t len) {
+	const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) hex_digits));
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	size_t i;
+	for (i=0; i+32<=len; i+=32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+		__m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+		__m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+		__m256i a = _mm256_unpacklo_epi8(hi, lo), b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i *) (out + 2*i), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *) (out + 2*i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	return i;
+}
+
+// hex_values_ssse3 for 32 digits.
+__attribute__((target("avx2")))
+static __m256i hex_values_avx2(__m256i v, int *bad) {
+	__m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+	__m256i l = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i is_d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+	__m256i is_l = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+	*bad |= _mm256_movemask_epi8(_mm256_or_si256(is_d, is_l)) != -1;
+	return _mm256_or_si256(_mm256_and_si256(is_d, d),
+			_mm256_and_si256(is_l, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+// 64 hex digits -> 32 bytes per step, like hex_decode_ssse3.
+__attribute__((target("avx2")))
+static size_t hex_decode_avx2(unsigned char *out, const char *in, size_t len) {
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+	size_t i;
+	for (i=0; i+64<=len; i+=64) {
+		int bad = 0;
+		__m256i a = hex_values_avx2(_mm256_loadu_si256((const __m256i *) (in + i)), &bad);
+		__m256i b = hex_values_avx2(_mm256_loadu_si256((const __m256i *) (in + i + 32)), &bad);
+		if (bad) {
+			break;
+		}
+		a = _mm256_maddubs_epi16(a, weights);
+		b = _mm256_maddubs_epi16(b, weights);
+		__m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *) (out + i/2), v);
+	}
+	return i;
+}
+
+// 24 bytes -> 32 base64 digits per step: 12 bytes into each half, then the
+// same steps as base64_encode_ssse3 (reads 28 bytes, so stop 4 early).
+__attribute__((target("avx2")))
+static size_t base64_encode_avx2(char *out, const unsigned char *in, size_t len) {
+	const __m256i shift_lut = _mm256_broadcastsi128_si256(_mm_setr_epi8('a' - 26, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+	const __m256i spread = _mm256_broadcastsi128_si256(_mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+			4, 5, 3, 4, 1, 2, 0, 1));
+	size_t i, o = 0;
+	for (i=0; i+28<=len; i+=24, o+=32) {
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128((const __m128i *) (in + i))),
+				_mm_loadu_si128((const __m128i *) (in + i + 12)), 1);
+		v = _mm256_shuffle_epi8(v, spread);
+		__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+				_mm256_set1_epi32(0x04000040));
+		__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+				_mm256_set1_epi32(0x01000010));
+		__m256i idx = _mm256_or_si256(t0, t1);
+		__m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+		r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		r = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, r), idx);
+		_mm256_storeu_si256((__m256i *) (out + o), r);
+	}
+	return i;
+}
+
+// 32 base64 digits -> 24 bytes per step, like base64_decode_ssse3; each half
+// makes 12 bytes, which are closed up before storing. Writes 32 bytes, which
+// is still fine when decoding in place front to back.
+__attribute__((target("avx2")))
+static size_t base64_decode_avx2(unsigned char *out, const char *in, size_t len) {
+	const __m256i shift_lut = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 0, 19, 4, -65, -65,
+			-71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+	const __m256i mask_lut = _mm256_broadcastsi128_si256(_mm_setr_epi8((char) 0xa8, (char) 0xf8,
+			(char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8,
+			(char) 0xf8, (char) 0xf8, (char) 0xf0, 0x54, 0x50, 0x50, 0x50, 0x54));
+	const __m256i bit_lut = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x01, 0x02, 0x04, 0x08,
+			0x10, 0x20, 0x40, (char) 0x80, 0, 0, 0, 0, 0, 0, 0, 0));
+	const __m256i gather = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+			8, 14, 13, 12, -1, -1, -1, -1));
+	size_t i, o = 0;
+	for (i=0; i+32<=len; i+=32, o+=24) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), _mm256_set1_epi8(0x0f));
+		__m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0f));
+		__m256i ok = _mm256_and_si256(_mm256_shuffle_epi8(mask_lut, lo), _mm256_shuffle_epi8(bit_lut, hi));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(ok, _mm256_setzero_si256())) != 0) {
+			break;
+		}
+		__m256i slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+		__m256i shift = _mm256_or_si256(_mm256_andnot_si256(slash, _mm256_shuffle_epi8(shift_lut, hi)),
+				_mm256_and_si256(slash, _mm256_set1_epi8(16)));
+		v = _mm256_add_epi8(v, shift);
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, gather);
+		v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_storeu_si256((__m256i *) (out + o), v);
+	}
+	return i;
+}
+
+static int have_ssse3(void) {
+	static int known = -1;
+	if (known < 0) {
+		__builtin_cpu_init();
+		known = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	}
+	return known;
+}
+
+static int have_avx2(void) {
+	static int known = -1;
+	if (known < 0) {
+		__builtin_cpu_init();
+		known = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+	return known;
+}
+#endif
+
+// Number of characters armor_encode writes for len bytes.
+size_t armor_encoded_length(size_t len, int armor) {
+	return armor == ARMOR_HEX ? 2*len : armor == ARMOR_BASE64 ? (len + 2) / 3 * 4 : len;
+}
+
+// Encode len bytes of "in" as text into "out". Returns the number of characters.
+size_t armor_encode(char *out, const unsigned char *in, size_t len, int armor) {
+	size_t i = 0, o = 0;
+	if (armor == ARMOR_HEX) {
+#ifdef ARMOR_SIMD
+		if (have_avx2()) {
+			i = hex_encode_avx2(out, in, len);
+		}
+		if (have_ssse3()) {
+			i += hex_encode_ssse3(out + 2*i, in + i, len - i);
+		}
+#endif
+		for (; i<len; i++) {
+			out[2*i] = hex_digits[in[i] >> 4];
+			out[2*i + 1] = hex_digits[in[i] & 15];
+		}
+		return 2*len;
+	}
+#ifdef ARMOR_SIMD
+	if (have_avx2()) {
+		i = base64_encode_avx2(out, in, len);
+	}
+	if (have_ssse3()) {
+		i += base64_encode_ssse3(out + i / 3 * 4, in + i, len - i);
+	}
+	o = i / 3 * 4;
+#endif
+	for (; i+3<=len; i+=3, o+=4) {
+		uint32_t v = (in[i] << 16) | (in[i+1] << 8) | in[i+2];
+		out[o] = base64_digits[v >> 18];
+		out[o+1] = base64_digits[(v >> 12) & 63];
+		out[o+2] = base64_digits[(v >> 6) & 63];
+		out[o+3] = base64_digits[v & 63];
+	}
+	if (i < len) {
+		uint32_t v = (in[i] << 16) | (i+1 < len ? in[i+1] << 8 : 0);
+		out[o] = base64_digits[v >> 18];
+		out[o+1] = base64_digits[(v >> 12) & 63];
+		out[o+2] = i+1 < len ? base64_digits[(v >> 6) & 63] : '=';
+		out[o+3] = '=';
+		o += 4;
+	}
+	return o;
+}
+
+// Decode the text in buf back to bytes, in place. Trailing white space is
+// ignored. Returns the number of bytes, or -1 if the text isn't valid.
+long armor_decode_inplace(unsigned char *buf, size_t len, int armor) {
+	const char *in = (const char *) buf;
+	size_t i = 0, o = 0;
+	while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r' || buf[len-1] == ' ')) {
+		len--;
+	}
+	if (armor == ARMOR_HEX) {
+		if (len % 2 != 0) {
+			return -1;
+		}
+#ifdef ARMOR_SIMD
+		if (have_avx2()) {
+			i = hex_decode_avx2(buf, in, len);
+		}
+		if (have_ssse3()) {
+			i += hex_decode_ssse3(buf + i/2, in + i, len - i);
+		}
+#endif
+		for (; i<len; i+=2) {
+			int hi = hex_value(in[i]);
+			int lo = hex_value(in[i+1]);
+			if (hi < 0 || lo < 0) {
+				return -1;
+			}
+			buf[i/2] = (unsigned char) (hi << 4 | lo);
+		}
+		return (long) (len / 2);
+	}
+	if (len % 4 != 0) {
+		return -1;
+	}
+#ifdef ARMOR_SIMD
+	// Leave the last group to the scalar code, it may have '=' in it.
+	size_t body = len > 4 ? len - 4 : 0;
+	if (have_avx2()) {
+		i = base64_decode_avx2(buf, in, body);
+	}
+	if (have_ssse3()) {
+		i += base64_decode_ssse3(buf + i / 4 * 3, in + i, body - i);
+	}
+	o = i / 4 * 3;
+#endif
+	for (; i<len; i+=4) {
+		int a = base64_value(in[i]);
+		int b = base64_value(in[i+1]);
+		int c = in[i+2] == '=' && i+4 == len ? 0 : base64_value(in[i+2]);
+		int d = in[i+3] == '=' && i+4 == len ? 0 : base64_value(in[i+3]);
+		if (a < 0 || b < 0 || c < 0 || d < 0 || (in[i+2] == '=' && in[i+3] != '=')) {
+			return -1;
+		}
+		uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+		buf[o++] = (unsigned char) (v >> 16);
+		if (in[i+2] != '=') {
+			buf[o++] = (unsigned char) (v >> 8);
+		}
+		if (in[i+3] != '=') {
+			buf[o++] = (unsigned char) v;
+		}
+	}
+	return (long) o;
+}
+
+// Parse the argument of "-armor". Returns -1 if it isn't hex or base64.
+int armor_kind(const char *name) {
+	if (name == NULL) {
+		return -1;
+	} else if (!strcmp(name, "hex")) {
+		return ARMOR_HEX;
+	} else if (!strcmp(name, "base64")) {
+		return ARMOR_BASE64;
+	}
+	return -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Compression
+/////////////////////////////////////////////////////////////////////////////
+
+// "-z" compresses the message before it is encrypted, since ciphertext can't
+// be compressed afterwards. The compressor is a small LZ77 in the style of
+// LZ4: greedy matching through a hash table of 4-byte sequences, byte-aligned
+// tokens, so it is about as fast as reading the data.
+// Like -mac and -armor, -z works on the whole message in memory (see
+// crypt_file): compressing holds the message and its compressed copy at once.
+// Decompressing streams the output a chunk at a time, so it needs only the
+// ciphertext plus LZ_CHUNK, whatever size the header claims.
+// The stream starts with the original size, then has one chunk after the
+// other, each LZ_CHUNK bytes of input (the last may be shorter):
+//    u32 input bytes, u32 stored bytes (top bit set if stored uncompressed), data
+// Within a chunk, each sequence is a token (literal count << 4 | match length
+// - 4, 15 meaning more length bytes follow), the literals, and a 2 byte
+// offset back to the match. The last sequence of a chunk has no match.
+#define LZ_CHUNK (64 * 1024)
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_RAW 0x80000000u
+
+static void put32(unsigned char *p, uint32_t v) {
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+	p[2] = (unsigned char) (v >> 16);
+	p[3] = (unsigned char) (v >> 24);
+}
+
+static uint32_t get32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint32_t lz_hash(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Most bytes lz_compress can produce for len bytes of input.
+size_t lz_compressed_bound(size_t len) {
+	return 8 + len + 8 * (len / LZ_CHUNK + 1);
+}
+
+// Write a length that didn't fit in its 4 bits of the token.
+static unsigned char *lz_put_length(unsigned char *op, size_t n) {
+	for (; n >= 255; n -= 255) {
+		*op++ = 255;
+	}
+	*op++ = (unsigned char) n;
+	return op;
+}
+
+// Compress one chunk into op, writing at most limit bytes. Returns the number
+// of bytes written, or 0 if the chunk doesn't get smaller.
+static size_t lz_compress_chunk(unsigned char *out, const unsigned char *in, size_t len, size_t limit) {
+	uint32_t table[1 << LZ_HASH_BITS];
+	const unsigned char *ip = in, *anchor = in;
+	const unsigned char *end = in + len;
+	unsigned char *op = out;
+	unsigned char *oend = out + limit;
+	memset(table, 0xff, sizeof(table));
+	while (len >= LZ_MIN_MATCH && ip + LZ_MIN_MATCH <= end) {
+		uint32_t h = lz_hash(ip);
+		uint32_t cand = table[h];
+		table[h] = (uint32_t) (ip - in);
+		if (cand == 0xffffffffu || memcmp(in + cand, ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+		const unsigned char *match = in + cand;
+		size_t mlen = LZ_MIN_MATCH;
+		while (ip + mlen < end && match[mlen] == ip[mlen]) {
+			mlen++;
+		}
+		size_t lits = ip - anchor;
+		// token + literals + offset + worst case length bytes
+		if (op + 1 + lits + 2 + lits / 255 + mlen / 255 + 2 > oend) {
+			return 0;
+		}
+		unsigned char *token = op++;
+		*token = (unsigned char) ((lits < 15 ? lits : 15) << 4);
+		if (lits >= 15) {
+			op = lz_put_length(op, lits - 15);
+		}
+		memcpy(op, anchor, lits);
+		op += lits;
+		uint32_t off = (uint32_t) (ip - match);
+		*op++ = (unsigned char) off;
+		*op++ = (unsigned char) (off >> 8);
+		size_t m = mlen - LZ_MIN_MATCH;
+		*token |= (unsigned char) (m < 15 ? m : 15);
+		if (m >= 15) {
+			op = lz_put_length(op, m - 15);
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+	size_t lits = end - anchor;
+	if (op + 1 + lits + lits / 255 + 1 > oend) {
+		return 0;
+	}
+	*op++ = (unsigned char) ((lits < 15 ? lits : 15) << 4);
+	if (lits >= 15) {
+		op = lz_put_length(op, lits - 15);
+	}
+	memcpy(op, anchor, lits);
+	op += lits;
+	return op - out;
+}
+
+// Compress len bytes of "in" into "out", which must have room for
+// lz_compressed_bound(len) bytes. Returns the compressed size.
+size_t lz_compress(unsigned char *out, const unsigned char *in, size_t len) {
+	size_t off, o = 8;
+	put32(out, (uint32_t) len);
+	put32(out + 4, (uint32_t) ((uint64_t) len >> 32));
+	for (off=0; off<len; off+=LZ_CHUNK) {
+		size_t n = len - off < LZ_CHUNK ? len - off : LZ_CHUNK;
+		size_t z = lz_compress_chunk(out + o + 8, in + off, n, n - 1);
+		put32(out + o, (uint32_t) n);
+		if (z == 0) {
+			memcpy(out + o + 8, in + off, n);
+			put32(out + o + 4, (uint32_t) n | LZ_RAW);
+			o += 8 + n;
+		} else {
+			put32(out + o + 4, (uint32_t) z);
+			o += 8 + z;
+		}
+	}
+	return o;
+}
+
+// The original size recorded in a compressed stream, or -1 if there's none.
+long long lz_original_size(const unsigned char *in, size_t len) {
+	if (len < 8) {
+		return -1;
+	}
+	return (long long) (get32(in) | ((uint64_t) get32(in + 4) << 32));
+}
+
+// Read a length that didn't fit in its 4 bits of the token.
+static int lz_get_length(const unsigned char **ip, const unsigned char *end, size_t *n) {
+	unsigned char b;
+	do {
+		if (*ip >= end) {
+			return -1;
+		}
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+static int lz_decompress_chunk(unsigned char *out, size_t size, const unsigned char *ip, size_t len) {
+	const unsigned char *end = ip + len;
+	unsigned char *op = out, *oend = out + size;
+	while (ip < end) {
+		unsigned char token = *ip++;
+		size_t lits = token >> 4;
+		if (lits == 15 && lz_get_length(&ip, end, &lits) != 0) {
+			return -1;
+		}
+		if (lits > (size_t) (end - ip) || lits > (size_t) (oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, lits);
+		op += lits;
+		ip += lits;
+		if (ip == end) {
+			break;
+		}
+		if (end - ip < 2) {
+			return -1;
+		}
+		size_t off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t mlen = token & 15;
+		if (mlen == 15 && lz_get_length(&ip, end, &mlen) != 0) {
+			return -1;
+		}
+		mlen += LZ_MIN_MATCH;
+		if (off == 0 || off > (size_t) (op - out) || mlen > (size_t) (oend - op)) {
+			return -1;
+		}
+		const unsigned char *match = op - off;
+		size_t i;
+		for (i=0; i<mlen; i++) {      // may overlap, so byte by byte
+			op[i] = match[i];
+		}
+		op += mlen;
+	}
+	return op == oend ? 0 : -1;
+}
+
+// Decompress a stream made by lz_compress and write it to fp. The chunks
+// don't refer to each other, so they go through one LZ_CHUNK buffer: the
+// size in the header is only checked against what the chunks add up to, and
+// never decides how much memory is taken. Returns 0, or -1 if the stream is
+// damaged or a write failed.
+int lz_decompress_file(FILE *fp, const unsigned char *in, size_t len) {
+	long long size = lz_original_size(in, len);
+	unsigned char *out = size >= 0 ? malloc(LZ_CHUNK) : NULL;
+	size_t i = 8, o = 0;
+	int result = -1;
+	if (out == NULL) {
+		return -1;
+	}
+	while (i < len) {
+		if (len - i < 8) {
+			goto done;
+		}
+		size_t n = get32(in + i);
+		uint32_t stored = get32(in + i + 4);
+		size_t z = stored & ~LZ_RAW;
+		i += 8;
+		if (z > len - i || n > (size_t) size - o || n > LZ_CHUNK) {
+			goto done;
+		}
+		if (stored & LZ_RAW) {
+			if (z != n) {
+				goto done;
+			}
+			memcpy(out, in + i, n);
+		} else if (lz_decompress_chunk(out, n, in + i, z) != 0) {
+			goto done;
+		}
+		if (fwrite(out, 1, n, fp) != n) {
+			goto done;
+		}
+		i += z;
+		o += n;
+	}
+	result = o == (size_t) size ? 0 : -1;
+done:
+	free(out);
+	return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Thread pool
+/////////////////////////////////////////////////////////////////////////////
+
+// NUMA layout of the machine, read from sysfs. Elsewhere, or if sysfs can't
+// be read, the whole machine is a single node and nothing gets pinned.
+#define MAX_NUMA_NODES 64
+
+struct NUMA {
+	int nnodes;
+	int pinnable;                   // the nodes' CPUs are known, so workers can be pinned
+	int ncpus[MAX_NUMA_NODES];      // CPUs on each node
+#ifdef __linux__
+	cpu_set_t cpus[MAX_NUMA_NODES];
+#endif
+};
+
+// Parse a sysfs cpulist such as "0-3,8-11" into set. Returns the CPU count.
+#ifdef __linux__
+int parse_cpulist(const char *list, cpu_set_t *set) {
+	int count = 0;
+	CPU_ZERO(set);
+	while (*list != '\0' && *list != '\n') {
+		char *end;
+		long first = strtol(list, &end, 10), last = first, cpu;
+		if (end == list) {
+			break;
+		}
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+		}
+		for (cpu=first; cpu<=last && cpu<CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, set);
+			count++;
+		}
+		list = *end == ',' ? end + 1 : end;
+	}
+	return count;
+}
+#endif
+
+void numa_topology(struct NUMA *numa) {
+	numa->nnodes = 0;
+	numa->pinnable = 0;
+#ifdef __linux__
+	char path[64], list[4096];
+	int node;
+	for (node=0; node<MAX_NUMA_NODES; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *fp = fopen(path, "r");
+		if (fp == NULL) {
+			continue;
+		}
+		if (fgets(list, sizeof(list), fp) != NULL) {
+			int n = parse_cpulist(list, &numa->cpus[numa->nnodes]);
+			if (n > 0) {
+				numa->ncpus[numa->nnodes++] = n;
+				numa->pinnable = 1;
+			}
+		}
+		fclose(fp);
+	}
+#endif
+	if (numa->nnodes == 0) {
+		numa->nnodes = 1;
+		numa->ncpus[0] = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	}
+}
+
+// A fixed set of worker threads taking tasks off FIFO queues. The workers can
+// be pinned to NUMA nodes, in which case worker i runs on the CPUs of node
+// i % nodes, and besides the shared queue each node has a queue of its own,
+// so tasks that work on memory first touched on a node can be sent back there.
+struct TASK {
+	void (*run)(void *);
+	void *arg;
+	struct TASK *next;
+};
+
+struct POOL {
+	pthread_mutex_t lock;
+	pthread_cond_t work;    // signalled when a task is queued or the pool stops
+	pthread_cond_t idle;    // signalled when the last pending task finishes
+	struct TASK *head[MAX_NUMA_NODES + 1];  // one queue per node, then the shared one
+	struct TASK *tail[MAX_NUMA_NODES + 1];
+	int pending;            // tasks queued or running
+	int stop;
+	struct WORKER *workers;
+	int nthreads;
+	struct NUMA numa;
+	int nodes;              // number of nodes the workers are pinned to, 0 if not pinned
+};
+
+#define SHARED_QUEUE MAX_NUMA_NODES
+
+struct WORKER {
+	struct POOL *pool;
+	pthread_t thread;
+	int node;               // NUMA node the worker is pinned to, or -1
+};
+
+// Number of threads to use when the user didn't say: one per core.
+int default_threads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+static void *pool_worker(void *arg) {
+	struct WORKER *worker = arg;
+	struct POOL *pool = worker->pool;
+#ifdef __linux__
+	if (worker->node >= 0) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &pool->numa.cpus[worker->node]);
+	}
+#endif
+	trace_name_thread("worker", (int) (worker - pool->workers));
+	for (;;) {
+		int q = SHARED_QUEUE;
+		pthread_mutex_lock(&pool->lock);
+		for (;;) {
+			if (worker->node >= 0 && pool->head[worker->node] != NULL) {
+				q = worker->node;
+				break;
+			}
+			if (pool->head[SHARED_QUEUE] != NULL || pool->stop) {
+				break;
+			}
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->head[q] == NULL) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		struct TASK *task = pool->head[q];
+		pool->head[q] = task->next;
+		if (pool->head[q] == NULL) {
+			pool->tail[q] = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		task->run(task->arg);
+		free(task);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0) {
+			pthread_cond_broadcast(&pool->idle);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+// Start a pool of nthreads workers pinned to the first "nodes" NUMA nodes,
+// spread evenly. If nodes is 0 the workers aren't pinned. If nthreads <= 0,
+// start one per CPU on those nodes (one per core if not pinned).
+struct POOL *pool_start_on_nodes(int nthreads, int nodes) {
+	struct POOL *pool = calloc(1, sizeof(struct POOL));
+	int i;
+	if (pool == NULL) {
+		return NULL;
+	}
+	numa_topology(&pool->numa);
+	pool->nodes = !pool->numa.pinnable ? 0 : nodes < pool->numa.nnodes ? nodes : pool->numa.nnodes;
+	if (nthreads <= 0) {
+		nthreads = pool->nodes ? 0 : default_threads();
+		for (i=0; i<pool->nodes; i++) {
+			nthreads += pool->numa.ncpus[i];
+		}
+	}
+	pool->workers = malloc(nthreads * sizeof(struct WORKER));
+	if (pool->workers == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	for (pool->nthreads=0; pool->nthreads<nthreads; pool->nthreads++) {
+		struct WORKER *worker = &pool->workers[pool->nthreads];
+		worker->pool = pool;
+		worker->node = pool->nodes ? pool->nthreads % pool->nodes : -1;
+		if (pthread_create(&worker->thread, NULL, pool_worker, worker) != 0) {
+			break;
+		}
+	}
+	if (pool->nthreads == 0) {
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->work);
+		pthread_cond_destroy(&pool->idle);
+		free(pool->workers);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+// Start a pool of nthreads workers (one per core if nthreads <= 0).
+struct POOL *pool_start(int nthreads) {
+	return pool_start_on_nodes(nthreads, 0);
+}
+
+// Queue run(arg) on one of the workers of NUMA node "node" (any worker if
+// node is -1 or the pool isn't pinned). If the task can't be queued, it is
+// run right away on the calling thread.
+void pool_submit_to(struct POOL *pool, int node, void (*run)(void *), void *arg) {
+	struct TASK *task = malloc(sizeof(struct TASK));
+	int q = (node >= 0 && pool->nodes > 0) ? node % pool->nodes : SHARED_QUEUE;
+	if (task == NULL) {
+		run(arg);
+		return;
+	}
+	task->run = run;
+	task->arg = arg;
+	task->next = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail[q] != NULL) {
+		pool->tail[q]->next = task;
+	} else {
+		pool->head[q] = task;
+	}
+	pool->tail[q] = task;
+	pool->pending++;
+	if (q == SHARED_QUEUE) {
+		pthread_cond_signal(&pool->work);
+	} else {
+		// Only some of the workers can take it, so wake them all.
+		pthread_cond_broadcast(&pool->work);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_submit(struct POOL *pool, void (*run)(void *), void *arg) {
+	pool_submit_to(pool, -1, run, arg);
+}
+
+// Wait until every task submitted so far has finished.
+void pool_wait(struct POOL *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0) {
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Finish the queued tasks, then stop the workers and free the pool.
+void pool_stop(struct POOL *pool) {
+	int i;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i=0; i<pool->nthreads; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->idle);
+	free(pool->workers);
+	free(pool);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Cross-stream batching
+/////////////////////////////////////////////////////////////////////////////
+
+// A server with thousands of connections, each with its own key and a few
+// blocks at a time, never fills a 64-block batch from any one message. A
+// BATCHER takes whole-block messages from any number of threads and packs
+// blocks from all of them into full batches, each lane with its own key
+// schedule (and its own counter in CTR mode). A message waits at most
+// max_delay for company; then a partial batch goes anyway.
+// DESKEY and DESJOB are in DES.h.
+#define BATCHER_LANES 64
+
+void des_key_init(DESKEY *k, KEYTYPE key) {
+	key_schedule_bulk_table(&key, 1, &k->enc, &k->dec);
+}
+
+struct BATCHER {
+	pthread_mutex_t lock;
+	pthread_cond_t work;      // signalled when blocks are queued or the batcher stops
+	DESJOB *head, *tail;      // jobs with blocks not yet in a batch, oldest first
+	size_t queued;            // blocks not yet in a batch
+	uint64_t max_delay;       // ns
+	int stop;
+	pthread_t *threads;
+	int nthreads;
+	uint64_t batches, lanes;  // for stats: batches run and lanes filled
+};
+
+static uint64_t batcher_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// What one dispatcher took out of the queue for a batch: blocks
+// first..first+n-1 of job.
+struct BATCHPIECE {
+	DESJOB *job;
+	size_t first, n;
+};
+
+static void *batcher_worker(void *arg) {
+	struct BATCHER *b = arg;
+	BLOCKTYPE blocks[BATCHER_LANES];
+	unsigned char (*lanes[BATCHER_LANES])[8];
+	struct BATCHPIECE pieces[BATCHER_LANES];
+	static int next_index = 0;
+	trace_name_thread("batcher", __sync_fetch_and_add(&next_index, 1));
+	pthread_mutex_lock(&b->lock);
+	for (;;) {
+		// Wait for a full batch, or for the oldest job's deadline.
+		while (!b->stop && (b->head == NULL || (b->queued < BATCHER_LANES && batcher_clock() < b->head->deadline))) {
+			if (b->head == NULL) {
+				pthread_cond_wait(&b->work, &b->lock);
+			} else {
+				struct timespec ts = { b->head->deadline / 1000000000u, b->head->deadline % 1000000000u };
+				pthread_cond_timedwait(&b->work, &b->lock, &ts);
+			}
+		}
+		if (b->head == NULL) {
+			break;
+		}
+		int n = 0, npieces = 0, i;
+		while (n < BATCHER_LANES && b->head != NULL) {
+			DESJOB *job = b->head;
+			size_t k = job->nblocks - job->next;
+			if (k > (size_t) (BATCHER_LANES - n)) {
+				k = BATCHER_LANES - n;
+			}
+			pieces[npieces].job = job;
+			pieces[npieces].first = job->next;
+			pieces[npieces++].n = k;
+			job->next += k;
+			n += (int) k;
+			if (job->next == job->nblocks) {
+				b->head = job->link;
+				if (b->head == NULL) {
+					b->tail = NULL;
+				}
+			}
+		}
+		b->queued -= n;
+		b->batches++;
+		b->lanes += n;
+		if (b->queued >= BATCHER_LANES) {
+			pthread_cond_signal(&b->work);
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		uint64_t t = trace_begin();
+		for (i=0, n=0; i<npieces; i++) {
+			DESJOB *job = pieces[i].job;
+			unsigned char (*s)[8] = (job->mode == DES_ECB && job->decrypting) ? job->key->dec : job->key->enc;
+			size_t j;
+			for (j=0; j<pieces[i].n; j++, n++) {
+				if (job->mode == DES_CTR) {
+					blocks[n] = job->counter + pieces[i].first + j;
+				} else {
+					memcpy(&blocks[n], job->buf + 8*(pieces[i].first + j), 8);
+				}
+				lanes[n] = s;
+			}
+		}
+		simd_crypt_lanes(blocks, n, lanes);
+		for (i=0, n=0; i<npieces; i++) {
+			DESJOB *job = pieces[i].job;
+			size_t j;
+			for (j=0; j<pieces[i].n; j++, n++) {
+				unsigned char *p = job->buf + 8*(pieces[i].first + j);
+				if (job->mode == DES_CTR) {
+					BLOCKTYPE v;
+					memcpy(&v, p, 8);
+					blocks[n] ^= v;
+				}
+				memcpy(p, &blocks[n], 8);
+			}
+		}
+		trace_end("batch", t, 8*n);
+
+		pthread_mutex_lock(&b->lock);
+		int ncallbacks = 0;
+		for (i=0; i<npieces; i++) {
+			DESJOB *job = pieces[i].job;
+			job->done += pieces[i].n;
+			if (job->done < job->nblocks) {
+				continue;
+			}
+			if (job->finished != NULL) {
+				pieces[ncallbacks++].job = job;
+			} else {
+				pthread_cond_signal(&job->ready);
+			}
+		}
+		if (ncallbacks > 0) {
+			pthread_mutex_unlock(&b->lock);
+			for (i=0; i<ncallbacks; i++) {
+				pieces[i].job->finished(pieces[i].job);
+			}
+			pthread_mutex_lock(&b->lock);
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+// Start nthreads dispatchers (one per core if nthreads <= 0) that wait at most
+// max_delay_us microseconds to fill a batch.
+struct BATCHER *batcher_start(int nthreads, long max_delay_us) {
+	struct BATCHER *b = calloc(1, sizeof(struct BATCHER));
+	pthread_condattr_t attr;
+	if (b == NULL) {
+		return NULL;
+	}
+	if (nthreads <= 0) {
+		nthreads = default_threads();
+	}
+	b->threads = malloc(nthreads * sizeof(pthread_t));
+	if (b->threads == NULL) {
+		free(b);
+		return NULL;
+	}
+	b->max_delay = (uint64_t) (max_delay_us > 0 ? max_delay_us : 0) * 1000;
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&b->work, &attr);
+	pthread_condattr_destroy(&attr);
+	des_init();
+	for (b->nthreads=0; b->nthreads<nthreads; b->nthreads++) {
+		if (pthread_create(&b->threads[b->nthreads], NULL, batcher_worker, b) != 0) {
+			break;
+		}
+	}
+	if (b->nthreads == 0) {
+		pthread_mutex_destroy(&b->lock);
+		pthread_cond_destroy(&b->work);
+		free(b->threads);
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+// Queue a job. Returns right away; the blocks are done when batcher_wait
+// returns, or when job->finished is called (maybe before this returns).
+void batcher_submit(struct BATCHER *b, DESJOB *job) {
+	job->next = 0;
+	job->done = 0;
+	job->link = NULL;
+	if (job->nblocks == 0) {
+		if (job->finished != NULL) {
+			job->finished(job);
+		}
+		return;
+	}
+	if (job->finished == NULL) {
+		pthread_cond_init(&job->ready, NULL);
+	}
+	job->deadline = batcher_clock() + b->max_delay;
+	pthread_mutex_lock(&b->lock);
+	if (b->tail != NULL) {
+		b->tail->link = job;
+	} else {
+		b->head = job;
+	}
+	b->tail = job;
+	b->queued += job->nblocks;
+	// A dispatcher has to start a timed wait for the first job, and take a
+	// full batch as soon as there is one.
+	if (b->head == job || b->queued >= BATCHER_LANES) {
+		pthread_cond_signal(&b->work);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+// Wait for a job submitted without a finished callback.
+void batcher_wait(struct BATCHER *b, DESJOB *job) {
+	if (job->nblocks == 0) {
+		return;
+	}
+	pthread_mutex_lock(&b->lock);
+	while (job->done < job->nblocks) {
+		pthread_cond_wait(&job->ready, &b->lock);
+	}
+	pthread_mutex_unlock(&b->lock);
+	pthread_cond_destroy(&job->ready);
+}
+
+// Finish the queued jobs, then stop the dispatchers and free the batcher.
+void batcher_stop(struct BATCHER *b) {
+	int i;
+	pthread_mutex_lock(&b->lock);
+	b->stop = 1;
+	pthread_cond_broadcast(&b->work);
+	pthread_mutex_unlock(&b->lock);
+	for (i=0; i<b->nthreads; i++) {
+		pthread_join(b->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->work);
+	free(b->threads);
+	free(b);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Batch mode
+/////////////////////////////////////////////////////////////////////////////
+
+// "des -enc -ecb -batch LIST" encrypts every file named in LIST (one path per
+// line), or every regular file in LIST if it's a directory, in one process.
+// Each file F is encrypted to F.des; decrypting F.des writes F again (files
+// without the .des suffix get .dec appended instead). In a directory, only
+// the .des files are decrypted, and they are left out when encrypting, so
+// running the batch again doesn't encrypt its own outputs.
+// Files of at least batch_chunk bytes are cut into batch_chunk pieces that are
+// read, encrypted and written to their place in the output in parallel, each
+// by the worker that will encrypt it, so with -numa the pages of a chunk live
+// on the node that works on them, and only the chunks being worked on are in
+// memory, however big the file.
+// Smaller files are handed to the workers in groups of about batch_chunk
+// bytes, so that no task is too small to be worth queueing.
+// batch_chunk and batch_threads (0: one per core) come from the tuner.
+#define BATCH_CHUNK (1 << 20)
+size_t batch_chunk = BATCH_CHUNK;
+int batch_threads = 0;
+#define BATCH_GROUP_FILES 64
+#define BATCH_INFLIGHT (256 << 20)   // max bytes of large files queued at once
+
+struct BATCH {
+	int mode;               // DES_ECB or DES_CTR
+	int decrypting;
+	int mac;                // append/check a CMAC tag; such files can't be split
+	int armor;              // ARMOR_NONE, ARMOR_HEX or ARMOR_BASE64
+	int numa;               // pin the workers to the machine's NUMA nodes
+	int compress;           // -z: compress before encrypting; such files can't be split
+	int failed;             // files that couldn't be processed, updated atomically
+	int quiet;              // don't print the summary
+};
+
+struct BATCHFILE {
+	char *path;
+	long size;
+};
+
+struct BIGCHUNK {
+	struct BIGFILE *file;
+	size_t off;
+	size_t len;
+};
+
+// A large file, shared by the tasks of its chunks.
+struct BIGFILE {
+	struct BATCH *batch;
+	char *path;
+	int fd;
+	char *out;              // the output file, written a chunk at a time
+	int out_fd;
+	size_t size;            // bytes in the input file
+	size_t len;             // bytes to encrypt or decrypt, a multiple of 8
+	struct BIGCHUNK *chunks;
+	int chunks_left;        // chunks not finished yet, updated atomically
+	int failed;             // set if a chunk couldn't be read or written
+};
+
+struct SMALLGROUP {
+	struct BATCH *batch;
+	struct BATCHFILE *files;
+	int count;
+};
+
+// The name of the file the batch writes for "path". Free it when done.
+char *batch_output_path(const char *path, int decrypting) {
+	size_t n = strlen(path);
+	char *out = malloc(n + 5);
+	if (out == NULL) {
+		return NULL;
+	}
+	strcpy(out, path);
+	if (!decrypting) {
+		strcat(out, ".des");
+	} else if (n > 4 && !strcmp(path + n - 4, ".des")) {
+		out[n - 4] = '\0';
+	} else {
+		strcat(out, ".dec");
+	}
+	return out;
+}
+
+// Read a whole file into a new buffer with "extra" spare bytes at the end.
+unsigned char *read_whole_file(const char *path, size_t *len, size_t extra) {
+	uint64_t t = trace_begin();
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	unsigned char *buf = size >= 0 ? malloc(size + extra) : NULL;
+	if (buf == NULL || fread(buf, 1, size, fp) != (size_t) size) {
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	*len = size;
+	trace_end("read", t, size);
+	return buf;
+}
+
+int write_whole_file(const char *path, const unsigned char *buf, size_t len) {
+	uint64_t t = trace_begin();
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		return -1;
+	}
+	size_t written = fwrite(buf, 1, len, fp);
+	if (fclose(fp) != 0 || written != len) {
+		return -1;
+	}
+	trace_end("write", t, len);
+	return 0;
+}
+
+// Like read_whole_file, but if the file is armored the text is decoded (in
+// place) and *len is the number of bytes it held.
+unsigned char *read_input_file(const char *path, size_t *len, size_t extra, int armor) {
+	unsigned char *buf = read_whole_file(path, len, extra);
+	if (buf == NULL || armor == ARMOR_NONE) {
+		return buf;
+	}
+	long decoded = armor_decode_inplace(buf, *len, armor);
+	if (decoded < 0) {
+		free(buf);
+		return NULL;
+	}
+	*len = decoded;
+	return buf;
+}
+
+// Bytes armored per step by write_output_file; a multiple of 3 and of 8.
+#define ARMOR_CHUNK (48 * 1024)
+
+// Write len bytes from buf to path, armored as asked. The text is made
+// ARMOR_CHUNK bytes at a time through a small buffer. If ctx isn't NULL, each
+// chunk of (padded) blocks is encrypted right before it is encoded, so the
+// cipher and the armor pass over the data once, while it's in cache.
+int write_output_file(const char *path, unsigned char *buf, size_t len, int armor, DESCTX *ctx) {
+	char text[2 * ARMOR_CHUNK + 1];
+	size_t off;
+	if (armor == ARMOR_NONE) {
+		if (ctx != NULL) {
+			des_crypt_blocks(ctx, buf, len / 8, 0);
+		}
+		return write_whole_file(path, buf, len);
+	}
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		return -1;
+	}
+	int result = 0;
+	for (off=0; off<len; off+=ARMOR_CHUNK) {
+		size_t n = len - off < ARMOR_CHUNK ? len - off : ARMOR_CHUNK;
+		if (ctx != NULL) {
+			des_crypt_blocks(ctx, buf + off, n / 8, 0);
+		}
+		uint64_t t = trace_begin();
+		n = armor_encode(text, buf + off, n, armor);
+		trace_end("armor", t, n);
+		t = trace_begin();
+		if (fwrite(text, 1, n, fp) != n) {
+			result = -1;
+			break;
+		}
+		trace_end("write", t, n);
+	}
+	if (fputc('\n', fp) == EOF) {
+		result = -1;
+	}
+	if (fclose(fp) != 0) {
+		result = -1;
+	}
+	return result;
+}
+
+// Compress the len bytes in buf with lz_compress. Returns a new buffer with
+// room for the padding and the tag, and frees the old one; or NULL.
+unsigned char *compress_buffer(unsigned char *buf, size_t *len) {
+	unsigned char *z = malloc(lz_compressed_bound(*len) + 8 + DES_TAG_SIZE);
+	if (z != NULL) {
+		uint64_t t = trace_begin();
+		size_t raw = *len;
+		*len = lz_compress(z, buf, raw);
+		trace_end("compress", t, raw);
+	}
+	free(buf);
+	return z;
+}
+
+// Decompress the len bytes in buf and write them to path, a chunk at a time.
+// Returns 0, or -1 (and no file) if anything went wrong.
+int write_decompressed(const char *path, const unsigned char *buf, size_t len) {
+	uint64_t t = trace_begin();
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		return -1;
+	}
+	int result = lz_decompress_file(fp, buf, len);
+	if (fclose(fp) != 0) {
+		result = -1;
+	}
+	if (result != 0) {
+		remove(path);
+	}
+	trace_end("decompress", t, len);
+	return result;
+}
+
+// Encrypt or decrypt the file "in" into "out" in one go, in memory, on the
+// calling thread. ctx says how. With "compress", the message is compressed
+// before encrypting and decompressed after decrypting. Returns 0, or -1 if
+// anything went wrong (including a CMAC tag that doesn't match).
+int crypt_file(DESCTX *ctx, const char *in, const char *out, int decrypting, int armor, int compress) {
+	size_t len;
+	long result = -1;
+	unsigned char *buf = read_input_file(in, &len, 8 + DES_TAG_SIZE, decrypting ? armor : ARMOR_NONE);
+	if (buf != NULL && compress && !decrypting) {
+		buf = compress_buffer(buf, &len);
+	}
+	if (buf != NULL) {
+		if (decrypting) {
+			result = des_decrypt_inplace(ctx, buf, len, len);
+			if (result >= 0) {
+				result = compress ? write_decompressed(out, buf, result)
+						: write_whole_file(out, buf, result);
+			}
+		} else if (!ctx->mac) {
+			// Let the writer encrypt each chunk just before it armors it.
+			result = write_output_file(out, buf, des_pad_inplace(buf, len), armor, ctx);
+		} else {
+			result = des_encrypt_inplace(ctx, buf, len, len + 8 + DES_TAG_SIZE);
+			if (result >= 0) {
+				result = write_output_file(out, buf, result, armor, NULL);
+			}
+		}
+	}
+	free(buf);
+	return result < 0 ? -1 : 0;
+}
+
+// Encrypt or decrypt one file of the batch completely, on the calling thread.
+int batch_one_file(struct BATCH *batch, const char *path) {
+	DESCTX ctx;
+	int result = -1;
+	char *out = batch_output_path(path, batch->decrypting);
+	if (out != NULL) {
+		des_ctx_init(&ctx, batch->mode);
+		ctx.mac = batch->mac;
+		result = crypt_file(&ctx, path, out, batch->decrypting, batch->armor, batch->compress);
+	}
+	if (result < 0) {
+		fprintf(stderr, "batch: can't process %s\n", path);
+	}
+	free(out);
+	return result;
+}
+
+static void batch_small_group(void *arg) {
+	struct SMALLGROUP *group = arg;
+	int i;
+	for (i=0; i<group->count; i++) {
+		if (batch_one_file(group->batch, group->files[i].path) != 0) {
+			__sync_fetch_and_add(&group->batch->failed, 1);
+		}
+	}
+	free(group);
+}
+
+// Read exactly n bytes at offset off of fd. Returns 0, or -1.
+int read_at(int fd, unsigned char *buf, size_t n, size_t off) {
+	uint64_t t = trace_begin();
+	size_t total = n;
+	while (n > 0) {
+		ssize_t got = pread(fd, buf, n, (off_t) off);
+		if (got <= 0) {
+			return -1;
+		}
+		buf += got;
+		off += got;
+		n -= got;
+	}
+	trace_end("read", t, total);
+	return 0;
+}
+
+// Write exactly n bytes from buf at offset off of fd. Returns 0, or -1.
+int write_at(int fd, const void *buf, size_t n, size_t off) {
+	uint64_t t = trace_begin();
+	const unsigned char *p = buf;
+	size_t total = n;
+	while (n > 0) {
+		ssize_t put = pwrite(fd, p, n, (off_t) off);
+		if (put <= 0) {
+			return -1;
+		}
+		p += put;
+		off += put;
+		n -= put;
+	}
+	trace_end("write", t, total);
+	return 0;
+}
+
+// Write the len bytes of buf, which start off bytes into the output, to their
+// place in fd, armored as asked. With base64, off must be a multiple of 3.
+int write_chunk_at(int fd, const unsigned char *buf, size_t len, size_t off, int armor) {
+	char text[2 * ARMOR_CHUNK + 1];
+	size_t done;
+	if (armor == ARMOR_NONE) {
+		return write_at(fd, buf, len, off);
+	}
+	for (done=0; done<len; done+=ARMOR_CHUNK) {
+		size_t n = len - done < ARMOR_CHUNK ? len - done : ARMOR_CHUNK;
+		uint64_t t = trace_begin();
+		n = armor_encode(text, buf + done, n, armor);
+		trace_end("armor", t, n);
+		if (write_at(fd, text, n, armor_encoded_length(off + done, armor)) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Read, encrypt and write one chunk of a large file; the last chunk also gets
+// the padding (or has it taken off). Whoever finishes last closes the file,
+// and removes it if any chunk failed.
+static void batch_big_chunk(void *arg) {
+	struct BIGCHUNK *chunk = arg;
+	struct BIGFILE *file = chunk->file;
+	struct BATCH *batch = file->batch;
+	size_t have = file->size - chunk->off < chunk->len ? file->size - chunk->off : chunk->len;
+	int last = chunk->off + chunk->len == file->len;
+	int armor = batch->decrypting ? ARMOR_NONE : batch->armor;
+	unsigned char *buf = alloc_block_storage(chunk->len);
+	long len = (long) chunk->len;
+	DESCTX ctx;
+	if (buf == NULL || read_at(file->fd, buf, have, chunk->off) != 0) {
+		file->failed = 1;
+	} else {
+		if (have < chunk->len) {
+			des_pad_inplace(buf, have);
+		}
+		des_ctx_init(&ctx, batch->mode);
+		ctx.counter = chunk->off / 8;
+		des_crypt_blocks(&ctx, buf, chunk->len / 8, batch->decrypting);
+		if (batch->decrypting && last) {
+			len = des_unpadded_length(buf, chunk->len);
+		}
+		if (len < 0 || write_chunk_at(file->out_fd, buf, len, chunk->off, armor) != 0
+				|| (last && armor != ARMOR_NONE
+					&& write_at(file->out_fd, "\n", 1, armor_encoded_length(file->len, armor)) != 0)) {
+			file->failed = 1;
+		}
+	}
+	free_block_storage(buf, chunk->len);
+	if (__sync_sub_and_fetch(&file->chunks_left, 1) > 0) {
+		return;
+	}
+
+	if (close(file->out_fd) != 0 || file->failed) {
+		fprintf(stderr, "batch: can't process %s\n", file->path);
+		remove(file->out);
+		__sync_fetch_and_add(&batch->failed, 1);
+	}
+	close(file->fd);
+	free(file->out);
+	free(file->chunks);
+	free(file);
+}
+
+// Queue the chunks of a large file. Returns the number of bytes queued.
+size_t batch_big_file(struct POOL *pool, struct BATCH *batch, const char *path, size_t size) {
+	struct BIGFILE *file = calloc(1, sizeof(struct BIGFILE));
+	size_t step = batch_chunk;
+	int i, n;
+	if (file == NULL) {
+		goto fail;
+	}
+	file->fd = file->out_fd = -1;
+	if (batch->decrypting && size % 8 != 0) {
+		goto fail;
+	}
+	file->batch = batch;
+	file->path = (char *) path;
+	file->size = size;
+	file->len = batch->decrypting ? size : des_padded_length(size);
+	// Base64 turns 3 bytes into 4 characters, so each chunk must start at a
+	// multiple of 3 to have a place of its own in the text.
+	if (!batch->decrypting && batch->armor == ARMOR_BASE64) {
+		step -= step % 24;
+	}
+	n = (int) ((file->len + step - 1) / step);
+	file->chunks = malloc(n * sizeof(struct BIGCHUNK));
+	file->out = batch_output_path(path, batch->decrypting);
+	if (file->chunks == NULL || file->out == NULL) {
+		goto fail;
+	}
+	file->fd = open(path, O_RDONLY);
+	if (file->fd < 0) {
+		goto fail;
+	}
+	file->out_fd = open(file->out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (file->out_fd < 0) {
+		goto fail;
+	}
+	file->chunks_left = n;
+	for (i=0; i<n; i++) {
+		file->chunks[i].file = file;
+		file->chunks[i].off = (size_t) i * step;
+		file->chunks[i].len = i < n-1 ? step : file->len - (size_t) i * step;
+	}
+	size_t len = file->len;
+	for (i=0; i<n; i++) {
+		pool_submit(pool, batch_big_chunk, &file->chunks[i]);
+	}
+	return len;
+
+fail:
+	fprintf(stderr, "batch: can't process %s\n", path);
+	__sync_fetch_and_add(&batch->failed, 1);
+	if (file != NULL) {
+		if (file->fd >= 0) {
+			close(file->fd);
+		}
+		free(file->out);
+		free(file->chunks);
+	}
+	free(file);
+	return 0;
+}
+
+static int batch_by_size(const void *a, const void *b) {
+	long sa = ((const struct BATCHFILE *) a)->size;
+	long sb = ((const struct BATCHFILE *) b)->size;
+	return (sa < sb) - (sa > sb);
+}
+
+// Add path to the list of files, growing it as needed.
+int batch_add(struct BATCHFILE **files, int *count, int *cap, const char *path) {
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "batch: skipping %s\n", path);
+		return -1;
+	}
+	if (*count == *cap) {
+		int ncap = *cap ? 2 * *cap : 256;
+		struct BATCHFILE *grown = realloc(*files, ncap * sizeof(struct BATCHFILE));
+		if (grown == NULL) {
+			return -1;
+		}
+		*files = grown;
+		*cap = ncap;
+	}
+	(*files)[*count].path = strdup(path);
+	(*files)[*count].size = (long) st.st_size;
+	if ((*files)[*count].path == NULL) {
+		return -1;
+	}
+	(*count)++;
+	return 0;
+}
+
+// Collect the files named in a list file, or found in a directory (the .des
+// files when decrypting, the others when encrypting) into *files. Returns 0,
+// or -1 if the list can't be read.
+int batch_collect(const char *list, int decrypting, struct BATCHFILE **files, int *count) {
+	int cap = 0;
+	char path[4096];
+	struct stat st;
+	*files = NULL;
+	*count = 0;
+	if (stat(list, &st) == 0 && S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(list);
+		struct dirent *entry;
+		if (dir == NULL) {
+			return -1;
+		}
+		while ((entry = readdir(dir)) != NULL) {
+			size_t n = strlen(entry->d_name);
+			int des = n > 4 && !strcmp(entry->d_name + n - 4, ".des");
+			if (entry->d_name[0] == '.' || des != decrypting) {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s", list, entry->d_name);
+			batch_add(files, count, &cap, path);
+		}
+		closedir(dir);
+		return 0;
+	}
+	FILE *fp = fopen(list, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	while (fgets(path, sizeof(path), fp) != NULL) {
+		path[strcspn(path, "\r\n")] = '\0';
+		if (path[0] != '\0') {
+			batch_add(files, count, &cap, path);
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+// Run the whole batch on nthreads workers; "batch" says how. Returns the
+// number of files that failed, or -1 if the list can't be read.
+int run_batch(const char *list, struct BATCH *options, int nthreads) {
+	struct BATCH batch = *options;
+	struct BATCHFILE *files;
+	int count, i;
+	if (batch_collect(list, batch.decrypting, &files, &count) != 0) {
+		fprintf(stderr, "batch: can't read %s\n", list);
+		return -1;
+	}
+	if (count == 0) {
+		printf("batch: no files to %s in %s\n", batch.decrypting ? "decrypt" : "encrypt", list);
+		free(files);
+		return 0;
+	}
+	struct POOL *pool = pool_start_on_nodes(nthreads, batch.numa ? MAX_NUMA_NODES : 0);
+	if (pool == NULL) {
+		for (i=0; i<count; i++) {
+			if (batch_one_file(&batch, files[i].path) != 0) {
+				__sync_fetch_and_add(&batch.failed, 1);
+			}
+		}
+	} else {
+		// Largest files first, so the long jobs don't end up last. The MAC
+		// is one chain over the whole file, and compressed or armored input
+		// has to be decoded as a whole, so then every file is a single task
+		// (large ones end up in a group of their own).
+		int split = !batch.mac && !batch.compress && !(batch.decrypting && batch.armor != ARMOR_NONE);
+		qsort(files, count, sizeof(struct BATCHFILE), batch_by_size);
+		size_t inflight = 0;
+		for (i=0; i<count && split && files[i].size >= (long) batch_chunk; i++) {
+			inflight += batch_big_file(pool, &batch, files[i].path, files[i].size);
+			if (inflight >= BATCH_INFLIGHT) {
+				pool_wait(pool);
+				inflight = 0;
+			}
+		}
+		while (i < count) {
+			struct SMALLGROUP *group = malloc(sizeof(struct SMALLGROUP));
+			long bytes = 0;
+			int n = 0;
+			while (i+n < count && n < BATCH_GROUP_FILES && bytes < (long) batch_chunk) {
+				bytes += files[i+n].size;
+				n++;
+			}
+			if (group == NULL) {
+				for (; n>0; n--, i++) {
+					if (batch_one_file(&batch, files[i].path) != 0) {
+						__sync_fetch_and_add(&batch.failed, 1);
+					}
+				}
+				continue;
+			}
+			group->batch = &batch;
+			group->files = files + i;
+			group->count = n;
+			pool_submit(pool, batch_small_group, group);
+			i += n;
+		}
+		pool_stop(pool);
+	}
+	if (!batch.quiet) {
+		printf("batch: %d files, %d failed\n", count, batch.failed);
+	}
+	for (i=0; i<count; i++) {
+		free(files[i].path);
+	}
+	free(files);
+	return batch.failed;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Checkpointed streaming
+/////////////////////////////////////////////////////////////////////////////
+
+// "-checkpoint [MB]" encrypts or decrypts the hardcoded files a STREAM_CHUNK
+// at a time instead of all at once, and every MB megabytes (default 256)
+// makes the output durable and records in "<output>.ckpt" how far it got:
+// input and output offsets, the mode's state (the counter, for CTR; ECB has
+// none) and a fingerprint of the key. After a crash, "-resume" truncates
+// the output back to the last checkpoint and carries on from there. The
+// checkpoint file is removed once the job is done.
+#define STREAM_CHUNK (8 << 20)
+#define CHECKPOINT_MAGIC 0x32544b4353454400ULL   // "\0DESCKT2"
+#define CHECKPOINT_LABEL 0x3154504b432d4544ULL    // "DE-CKPT1"
+
+struct CHECKPOINT {
+	uint64_t magic;
+	uint64_t input_size;    // to notice a different input file
+	uint64_t input_off;
+	uint64_t output_off;
+	uint64_t counter;       // CTR counter of the next block
+	uint64_t key_check;     // checkpoint_key_check(), to notice a different key
+	int32_t mode;
+	int32_t decrypting;
+};
+
+// A fingerprint of the current key: D_K(CHECKPOINT_LABEL). Not E_K(0), which
+// is CTR's first keystream block and would give away the start of the
+// message to anyone who can read the checkpoint.
+uint64_t checkpoint_key_check(void) {
+	BLOCKTYPE k = CHECKPOINT_LABEL;
+	table_crypt(&k, 1, 1);
+	return k;
+}
+
+// Write the checkpoint to a temporary file and rename it over the old one,
+// so that there's always one complete checkpoint on disk.
+int save_checkpoint(const char *path, const struct CHECKPOINT *ck) {
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *fp = fopen(tmp, "wb");
+	if (fp == NULL) {
+		return -1;
+	}
+	int ok = fwrite(ck, sizeof(*ck), 1, fp) == 1 && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	if (fclose(fp) != 0 || !ok) {
+		remove(tmp);
+		return -1;
+	}
+	return rename(tmp, path);
+}
+
+int load_checkpoint(const char *path, struct CHECKPOINT *ck) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return -1;
+	}
+	int ok = fread(ck, sizeof(*ck), 1, fp) == 1 && ck->magic == CHECKPOINT_MAGIC;
+	fclose(fp);
+	return ok ? 0 : -1;
+}
+
+// Stream "in" to "out" through the cipher, checkpointing every "interval"
+// bytes of input. Returns 0, or -1 on any error (the last checkpoint stays).
+int stream_file(int mode, const char *in, const char *out, int decrypting,
+		size_t interval, int resume) {
+	char ckpath[4096];
+	struct CHECKPOINT ck;
+	struct stat st;
+	DESCTX ctx;
+	FILE *ifp = NULL, *ofp = NULL;
+	unsigned char *buf = NULL;
+	int result = -1;
+
+	snprintf(ckpath, sizeof(ckpath), "%s.ckpt", out);
+	if (stat(in, &st) != 0 || (decrypting && (st.st_size == 0 || st.st_size % 8 != 0))) {
+		return -1;
+	}
+	memset(&ck, 0, sizeof(ck));
+	ck.magic = CHECKPOINT_MAGIC;
+	ck.input_size = st.st_size;
+	ck.key_check = checkpoint_key_check();
+	ck.mode = mode;
+	ck.decrypting = decrypting;
+	if (resume) {
+		struct CHECKPOINT saved;
+		if (load_checkpoint(ckpath, &saved) != 0) {
+			printf("No checkpoint to resume from, starting over.\n");
+		} else if (saved.key_check != ck.key_check) {
+			fprintf(stderr, "The checkpoint was made with a different key.\n");
+			return -1;
+		} else if (saved.input_size != ck.input_size || saved.mode != mode
+				|| saved.decrypting != decrypting || saved.input_off % 8 != 0) {
+			fprintf(stderr, "The checkpoint is for a different job.\n");
+			return -1;
+		} else {
+			ck = saved;
+		}
+	}
+	ifp = fopen(in, "rb");
+	ofp = fopen(out, ck.output_off > 0 ? "r+b" : "wb");
+	buf = malloc(STREAM_CHUNK + 8);
+	if (ifp == NULL || ofp == NULL || buf == NULL
+			|| ftruncate(fileno(ofp), (off_t) ck.output_off) != 0
+			|| fseeko(ifp, (off_t) ck.input_off, SEEK_SET) != 0
+			|| fseeko(ofp, (off_t) ck.output_off, SEEK_SET) != 0) {
+		goto done;
+	}
+	des_ctx_init(&ctx, mode);
+	ctx.counter = ck.counter;
+
+	size_t since = 0;
+	for (;;) {
+		uint64_t t = trace_begin();
+		size_t n = fread(buf, 1, STREAM_CHUNK, ifp);
+		trace_end("read", t, n);
+		int last = ck.input_off + n == ck.input_size;
+		size_t len = n;
+		if (n < STREAM_CHUNK && !last) {
+			goto done;      // short read before the end: the input changed under us
+		}
+		if (last && !decrypting) {
+			len = des_pad_inplace(buf, n);
+		}
+		des_crypt_blocks(&ctx, buf, len / 8, decrypting);
+		if (last && decrypting) {
+			long real = des_unpadded_length(buf, len);
+			if (real < 0) {
+				goto done;
+			}
+			len = real;
+		}
+		t = trace_begin();
+		if (fwrite(buf, 1, len, ofp) != len) {
+			goto done;
+		}
+		trace_end("write", t, len);
+		ck.input_off += n;
+		ck.output_off += len;
+		ck.counter = ctx.counter;
+		since += n;
+		if (last) {
+			break;
+		}
+		if (since >= interval) {
+			if (fflush(ofp) != 0 || fsync(fileno(ofp)) != 0 || save_checkpoint(ckpath, &ck) != 0) {
+				goto done;
+			}
+			since = 0;
+		}
+	}
+	if (fflush(ofp) == 0 && fsync(fileno(ofp)) == 0) {
+		result = 0;
+		remove(ckpath);
+	}
+
+done:
+	free(buf);
+	if (ifp != NULL) {
+		fclose(ifp);
+	}
+	if (ofp != NULL && fclose(ofp) != 0) {
+		result = -1;
+	}
+	return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Lazy reader
+/////////////////////////////////////////////////////////////////////////////
+
+// A DESREADER reads a decrypted message out of an encrypted file the way
+// read() and lseek() read a plain one, and only decrypts the chunks that
+// are read. A background thread decrypts the next READER_AHEAD chunks after
+// the one last read, so a reader going through the file in order doesn't
+// wait. ECB and CTR blocks can both be decrypted on their own, so a seek
+// costs nothing. The padding is only looked at when a read gets to the
+// last block, or when the caller asks where the end is. There's no -mac:
+// the tag can't be checked until the whole file has been read.
+#define READER_CHUNK (64 << 10)
+#define READER_AHEAD 3
+#define READER_SLOTS (READER_AHEAD + 1)
+
+#define SLOT_EMPTY 0
+#define SLOT_LOADING 1
+#define SLOT_READY 2
+
+struct READERSLOT {
+	int state;
+	long chunk;              // chunk number, if not empty
+	size_t len;              // bytes in the chunk (the last one may be short)
+	unsigned char *buf;
+};
+
+typedef struct DESREADER {
+	int fd;
+	int mode;                // DES_ECB or DES_CTR
+	size_t size;             // of the ciphertext
+	long end;                // of the plaintext, or -1 until the padding has been seen
+	long pos;
+	long want;               // first chunk to keep, the one last read
+	int failed;              // a read error or bad padding
+	struct READERSLOT slots[READER_SLOTS];
+	pthread_mutex_t lock;
+	pthread_cond_t ahead;    // signalled when want changes or the reader closes
+	pthread_cond_t loaded;   // broadcast when a slot becomes ready
+	pthread_t thread;
+	int stop;
+} DESREADER;
+
+static long reader_chunks(DESREADER *r) {
+	return (long) ((r->size + READER_CHUNK - 1) / READER_CHUNK);
+}
+
+// The slot holding chunk c (loading or ready), or NULL.
+static struct READERSLOT *reader_find(DESREADER *r, long c) {
+	int i;
+	for (i=0; i<READER_SLOTS; i++) {
+		if (r->slots[i].state != SLOT_EMPTY && r->slots[i].chunk == c) {
+			return &r->slots[i];
+		}
+	}
+	return NULL;
+}
+
+// A slot that isn't loading and doesn't hold one of the chunks being kept.
+static struct READERSLOT *reader_victim(DESREADER *r) {
+	int i;
+	for (i=0; i<READER_SLOTS; i++) {
+		struct READERSLOT *s = &r->slots[i];
+		if (s->state == SLOT_EMPTY || (s->state == SLOT_READY
+				&& (s->chunk < r->want || s->chunk > r->want + READER_AHEAD))) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+// Read and decrypt chunk c into s, which the caller has marked as loading.
+// Called without the lock. Returns 0, or -1.
+static int reader_load(DESREADER *r, struct READERSLOT *s, long c) {
+	size_t off = (size_t) c * READER_CHUNK;
+	size_t len = r->size - off < READER_CHUNK ? r->size - off : READER_CHUNK;
+	DESCTX ctx;
+	if (read_at(r->fd, s->buf, len, off) != 0) {
+		return -1;
+	}
+	des_ctx_init(&ctx, r->mode);
+	ctx.counter = off / 8;
+	des_crypt_blocks(&ctx, s->buf, len / 8, 1);
+	s->len = len;
+	return 0;
+}
+
+// Mark s ready (or empty, if loading failed) and note where the plaintext
+// ends if it holds the last chunk. Called with the lock.
+static void reader_loaded(DESREADER *r, struct READERSLOT *s, long c, int result) {
+	if (result != 0) {
+		r->failed = 1;
+		s->state = SLOT_EMPTY;
+	} else {
+		s->state = SLOT_READY;
+		pthread_cond_signal(&r->ahead);    // the worker may have been waiting for a free slot
+		if (c == reader_chunks(r) - 1 && r->end < 0) {
+			long n = des_unpadded_length(s->buf, s->len);
+			if (n < 0) {
+				r->failed = 1;
+			} else {
+				r->end = (long) (r->size - s->len) + n;
+			}
+		}
+	}
+	pthread_cond_broadcast(&r->loaded);
+}
+
+static void *reader_worker(void *arg) {
+	DESREADER *r = arg;
+	trace_name_thread("read-ahead", 0);
+	pthread_mutex_lock(&r->lock);
+	while (!r->stop) {
+		struct READERSLOT *s = NULL;
+		long c;
+		for (c=r->want+1; c<=r->want+READER_AHEAD && c<reader_chunks(r); c++) {
+			if (reader_find(r, c) == NULL) {
+				s = reader_victim(r);
+				break;
+			}
+		}
+		if (s == NULL || r->failed) {
+			pthread_cond_wait(&r->ahead, &r->lock);
+			continue;
+		}
+		s->state = SLOT_LOADING;
+		s->chunk = c;
+		pthread_mutex_unlock(&r->lock);
+		int result = reader_load(r, s, c);
+		pthread_mutex_lock(&r->lock);
+		reader_loaded(r, s, c, result);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+// Open an encrypted file for reading, in mode DES_ECB or DES_CTR with the
+// current key. Returns NULL if it can't be opened or isn't whole blocks.
+DESREADER *des_reader_open(const char *path, int mode) {
+	DESREADER *r = calloc(1, sizeof(DESREADER));
+	struct stat st;
+	int i;
+	if (r == NULL) {
+		return NULL;
+	}
+	r->fd = open(path, O_RDONLY);
+	if (r->fd < 0 || fstat(r->fd, &st) != 0 || st.st_size <= 0 || st.st_size % 8 != 0) {
+		if (r->fd >= 0) {
+			close(r->fd);
+		}
+		free(r);
+		return NULL;
+	}
+	r->mode = mode;
+	r->size = (size_t) st.st_size;
+	r->end = -1;
+	for (i=0; i<READER_SLOTS; i++) {
+		r->slots[i].buf = malloc(READER_CHUNK);
+		if (r->slots[i].buf == NULL) {
+			while (i-- > 0) {
+				free(r->slots[i].buf);
+			}
+			close(r->fd);
+			free(r);
+			return NULL;
+		}
+	}
+	des_init();
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->ahead, NULL);
+	pthread_cond_init(&r->loaded, NULL);
+	if (pthread_create(&r->thread, NULL, reader_worker, r) != 0) {
+		r->stop = 1;    // no read-ahead, every chunk is loaded when it's read
+	}
+	return r;
+}
+
+// Make chunk c ready and return its slot, loading it on this thread if the
+// worker hasn't got to it. Called with the lock; NULL on errors.
+static struct READERSLOT *reader_get(DESREADER *r, long c) {
+	struct READERSLOT *s;
+	if (r->want != c) {
+		r->want = c;
+		pthread_cond_signal(&r->ahead);
+	}
+	for (;;) {
+		s = reader_find(r, c);
+		if (s != NULL && s->state == SLOT_READY) {
+			return s;
+		}
+		if (r->failed) {
+			return NULL;
+		}
+		if (s == NULL && (s = reader_victim(r)) != NULL) {
+			break;
+		}
+		pthread_cond_wait(&r->loaded, &r->lock);
+	}
+	s->state = SLOT_LOADING;
+	s->chunk = c;
+	pthread_mutex_unlock(&r->lock);
+	int result = reader_load(r, s, c);
+	pthread_mutex_lock(&r->lock);
+	reader_loaded(r, s, c, result);
+	return result == 0 ? s : NULL;
+}
+
+// Copy up to n bytes of plaintext from the current position into buf.
+// Returns the number of bytes read, 0 at the end, or -1 if the file can't
+// be read or the padding is wrong (wrong key or mode, or damaged).
+long des_reader_read(DESREADER *r, void *buf, size_t n) {
+	unsigned char *out = buf;
+	long total = 0;
+	pthread_mutex_lock(&r->lock);
+	while (n > 0 && !r->failed) {
+		// Everything before the last block is plaintext; from there on
+		// it's only known once the last chunk has been decrypted.
+		long limit = r->end >= 0 ? r->end : (long) r->size;
+		if (r->pos >= limit) {
+			break;
+		}
+		long c = r->pos / READER_CHUNK;
+		struct READERSLOT *s = reader_get(r, c);
+		if (s == NULL) {
+			break;
+		}
+		limit = r->end >= 0 ? r->end : (long) r->size;
+		long off = r->pos - c * READER_CHUNK;
+		long k = (long) s->len - off;
+		if (k > limit - r->pos) {
+			k = limit - r->pos;
+		}
+		if (k > (long) n) {
+			k = (long) n;
+		}
+		if (k <= 0) {
+			break;
+		}
+		memcpy(out, s->buf + off, k);
+		out += k;
+		n -= k;
+		r->pos += k;
+		total += k;
+	}
+	if (r->failed && total == 0) {
+		total = -1;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return total;
+}
+
+// Length of the plaintext: decrypts just the last block if no read has got
+// there yet. -1 on errors.
+long des_reader_size(DESREADER *r) {
+	unsigned char last[8];
+	DESCTX ctx;
+	pthread_mutex_lock(&r->lock);
+	long end = r->end;
+	pthread_mutex_unlock(&r->lock);
+	if (end >= 0) {
+		return end;
+	}
+	if (read_at(r->fd, last, 8, r->size - 8) != 0) {
+		return -1;
+	}
+	des_ctx_init(&ctx, r->mode);
+	ctx.counter = r->size / 8 - 1;
+	des_crypt_blocks(&ctx, last, 1, 1);
+	long n = des_unpadded_length(last, 8);
+	if (n < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&r->lock);
+	r->end = (long) r->size - 8 + n;
+	pthread_mutex_unlock(&r->lock);
+	return (long) r->size - 8 + n;
+}
+
+// Move the position like lseek (SEEK_SET, SEEK_CUR or SEEK_END). Seeking
+// past the end is allowed, reads there return 0. Returns the new position,
+// or -1.
+long des_reader_seek(DESREADER *r, long off, int whence) {
+	long base = 0;
+	if (whence == SEEK_END) {
+		base = des_reader_size(r);
+		if (base < 0) {
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&r->lock);
+	if (whence == SEEK_CUR) {
+		base = r->pos;
+	}
+	if (base + off < 0) {
+		pthread_mutex_unlock(&r->lock);
+		return -1;
+	}
+	r->pos = base + off;
+	pthread_mutex_unlock(&r->lock);
+	return base + off;
+}
+
+void des_reader_close(DESREADER *r) {
+	int i;
+	pthread_mutex_lock(&r->lock);
+	int started = !r->stop;
+	r->stop = 1;
+	pthread_cond_signal(&r->ahead);
+	pthread_mutex_unlock(&r->lock);
+	if (started) {
+		pthread_join(r->thread, NULL);
+	}
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->ahead);
+	pthread_cond_destroy(&r->loaded);
+	for (i=0; i<READER_SLOTS; i++) {
+		free(r->slots[i].buf);
+	}
+	close(r->fd);
+	free(r);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+/////////////////////////////////////////////////////////////////////////////
+
+double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// "des -bench -scaling" encrypts a big buffer of block storage with the
+// pool pinned to 1, 2, ... NUMA nodes. Each chunk is first touched by a worker
+// on the node it is assigned to, and always sent back to that node, so the
+// encryption only ever reads local memory.
+#define SCALING_CHUNK (4 << 20)
+#define SCALING_PASSES 3
+
+struct SCALINGCHUNK {
+	unsigned char *buf;
+	size_t len;
+	int touch;              // first pass: write the chunk instead of encrypting it
+};
+
+static void scaling_chunk(void *arg) {
+	struct SCALINGCHUNK *chunk = arg;
+	DESCTX ctx;
+	if (chunk->touch) {
+		memset(chunk->buf, 0x5a, chunk->len);
+		return;
+	}
+	des_ctx_init(&ctx, DES_ECB);
+	des_crypt_blocks(&ctx, chunk->buf, chunk->len / 8, 0);
+}
+
+void bench_scaling(size_t size, int nthreads) {
+	struct NUMA numa;
+	int nodes, i;
+	size_t n = (size + SCALING_CHUNK - 1) / SCALING_CHUNK;
+	double single = 0;
+	struct SCALINGCHUNK *chunks = malloc(n * sizeof(struct SCALINGCHUNK));
+	if (chunks == NULL) {
+		return;
+	}
+	numa_topology(&numa);
+	printf("nodes threads     MB/s  speedup\n");
+	for (nodes=1; nodes<=numa.nnodes; nodes++) {
+		struct POOL *pool = pool_start_on_nodes(nthreads > 0 ? nthreads * nodes : 0, nodes);
+		unsigned char *buf = alloc_block_storage(n * SCALING_CHUNK);
+		if (pool == NULL || buf == NULL) {
+			printf("can't set up %d nodes\n", nodes);
+			if (pool != NULL) {
+				pool_stop(pool);
+			}
+			free_block_storage(buf, n * SCALING_CHUNK);
+			break;
+		}
+		for (i=0; i<(int) n; i++) {
+			chunks[i].buf = buf + (size_t) i * SCALING_CHUNK;
+			chunks[i].len = SCALING_CHUNK;
+			chunks[i].touch = 1;
+			pool_submit_to(pool, i, scaling_chunk, &chunks[i]);
+		}
+		pool_wait(pool);
+		double start = now_seconds();
+		int pass;
+		for (pass=0; pass<SCALING_PASSES; pass++) {
+			for (i=0; i<(int) n; i++) {
+				chunks[i].touch = 0;
+				pool_submit_to(pool, i, scaling_chunk, &chunks[i]);
+			}
+			pool_wait(pool);
+		}
+		double rate = SCALING_PASSES * (double) (n * SCALING_CHUNK) / (now_seconds() - start) / 1e6;
+		if (nodes == 1) {
+			single = rate;
+		}
+		printf("%5d %7d %8.1f %7.2fx\n", nodes, pool->nthreads, rate, rate / single);
+		pool_stop(pool);
+		free_block_storage(buf, n * SCALING_CHUNK);
+	}
+	free(chunks);
+}
+
+// "des -bench -latency" times single small messages, one call at a time, and
+// prints the percentiles for messages of 1 to 8 blocks (7, 15, ... 63 bytes,
+// so the padding doesn't add a block). The list path that "des -enc" uses for
+// bigger messages is timed alongside for comparison.
+#define LATENCY_SAMPLES 100000
+
+static int compare_ns(const void *a, const void *b) {
+	long x = *(const long *) a, y = *(const long *) b;
+	return (x > y) - (x < y);
+}
+
+static long elapsed_ns(const struct timespec *t0, const struct timespec *t1) {
+	return (t1->tv_sec - t0->tv_sec) * 1000000000L + (t1->tv_nsec - t0->tv_nsec);
+}
+
+void bench_latency(long samples) {
+	long *ns = malloc(samples * sizeof(long));
+	unsigned char msg[DES_SMALL_MAX], out[DES_SMALL_MAX + 16];
+	int blocks, path;
+	long i;
+	if (ns == NULL || samples <= 0) {
+		free(ns);
+		return;
+	}
+	for (i=0; i<DES_SMALL_MAX; i++) {
+		msg[i] = (unsigned char) i;
+	}
+	table_init();
+	printf("blocks path       p50 ns   p99 ns  p999 ns\n");
+	for (blocks=1; blocks<=8; blocks++) {
+		for (path=0; path<2; path++) {
+			size_t len = 8*blocks - 1;
+			DESCTX ctx;
+			des_ctx_init(&ctx, DES_CTR);
+			for (i=0; i<samples; i++) {
+				struct timespec t0, t1;
+				clock_gettime(CLOCK_MONOTONIC, &t0);
+				if (path == 0) {
+					des_encrypt_small(&ctx, msg, len, out);
+				} else {
+					FILE *fp = fmemopen(msg, len, "r");
+					BLOCKLIST list = read_cleartext_message(fp);
+					fclose(fp);
+					des_enc_CTR(list);
+					free_block_storage(list, (len / 8 + 1) * sizeof(struct BLOCK));
+				}
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+				ns[i] = elapsed_ns(&t0, &t1);
+			}
+			qsort(ns, samples, sizeof(long), compare_ns);
+			printf("%6d %-8s %8ld %8ld %8ld\n", blocks, path == 0 ? "small" : "list",
+					ns[samples / 2], ns[samples * 99 / 100], ns[samples * 999 / 1000]);
+		}
+	}
+	free(ns);
+}
+
+// "des -bench -keys" expands a million keys into the engines' schedules, one
+// at a time with key_schedule and KEY_BATCH at a time with the bitsliced
+// key_schedule_bulk_table.
+#define BENCH_KEYS (1 << 20)
+
+void bench_keys(void) {
+	static unsigned char sched[KEY_BATCH][16][8];
+	unsigned char dec[16][8];
+	KEYTYPE keys[KEY_BATCH];
+	uint64_t subkeys[16];
+	KEYTYPE k;
+	int i;
+	double start = now_seconds();
+	for (k=0; k<BENCH_KEYS; k++) {
+		key_schedule(k, subkeys);
+		table_cut_subkeys(subkeys, sched[0], dec);
+	}
+	double one = now_seconds() - start;
+	start = now_seconds();
+	for (k=0; k<BENCH_KEYS; k+=KEY_BATCH) {
+		for (i=0; i<KEY_BATCH; i++) {
+			keys[i] = k + i;
+		}
+		key_schedule_bulk_table(keys, KEY_BATCH, sched, NULL);
+	}
+	double bulk = now_seconds() - start;
+	printf("one at a time %8.2f Mkeys/s\n", BENCH_KEYS / one / 1e6);
+	printf("bitsliced     %8.2f Mkeys/s\n", BENCH_KEYS / bulk / 1e6);
+}
+
+// "des -bench -streams" encrypts many small messages, each under one of
+// STREAM_KEYS keys, from many client threads at once: first each message on
+// its own with the table engine, then all of them through a BATCHER. A
+// third of the messages are in CTR mode, a third are ECB encrypted and a
+// third ECB decrypted. The batched results are checked against the others.
+#define STREAM_KEYS 1024
+#define STREAM_MAX_DEPTH 256
+
+struct STREAMBENCH {
+	struct BATCHER *batcher;  // NULL for the one-at-a-time pass
+	DESKEY *keys;
+	unsigned char *bufs;      // message i is at bufs + i*size
+	long messages, size;
+	int nclients;
+	int depth;                // messages each client has in flight
+	long *ns;                 // latency of each message
+};
+
+struct STREAMCLIENT {
+	struct STREAMBENCH *bench;
+	int id;
+	pthread_t thread;
+};
+
+static void stream_job(struct STREAMBENCH *sb, long i, DESJOB *job) {
+	job->mode = i % 3 == 0 ? DES_CTR : DES_ECB;
+	job->decrypting = i % 3 == 2;
+	job->key = &sb->keys[i % STREAM_KEYS];
+	job->counter = (BLOCKTYPE) i << 32;
+	job->buf = sb->bufs + i * sb->size;
+	job->nblocks = sb->size / 8;
+	job->finished = NULL;
+}
+
+// Message i on its own, the way a caller without a batcher would do it.
+static void stream_alone(struct STREAMBENCH *sb, long i) {
+	BLOCKTYPE blocks[DES_SMALL_BLOCKS * 8];
+	unsigned char (*lanes[DES_SMALL_BLOCKS * 8])[8];
+	DESJOB job;
+	size_t j;
+	stream_job(sb, i, &job);
+	for (j=0; j<job.nblocks; j++) {
+		if (job.mode == DES_CTR) {
+			blocks[j] = job.counter + j;
+		} else {
+			memcpy(&blocks[j], job.buf + 8*j, 8);
+		}
+		lanes[j] = job.decrypting ? job.key->dec : job.key->enc;
+	}
+	table_crypt_keys(blocks, job.nblocks, lanes);
+	for (j=0; j<job.nblocks; j++) {
+		if (job.mode == DES_CTR) {
+			BLOCKTYPE v;
+			memcpy(&v, job.buf + 8*j, 8);
+			blocks[j] ^= v;
+		}
+		memcpy(job.buf + 8*j, &blocks[j], 8);
+	}
+}
+
+// Client c takes messages c, c + nclients, ... With a batcher it has up to
+// sb->depth of them in flight at a time, like a server thread juggling
+// several connections.
+static void *stream_client(void *arg) {
+	struct STREAMCLIENT *c = arg;
+	struct STREAMBENCH *sb = c->bench;
+	DESJOB jobs[STREAM_MAX_DEPTH];
+	struct timespec t0[STREAM_MAX_DEPTH], t1;
+	long i, first;
+	int k, n;
+	if (sb->batcher == NULL) {
+		for (i=c->id; i<sb->messages; i+=sb->nclients) {
+			clock_gettime(CLOCK_MONOTONIC, &t0[0]);
+			stream_alone(sb, i);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			sb->ns[i] = elapsed_ns(&t0[0], &t1);
+		}
+		return NULL;
+	}
+	for (first=c->id; first<sb->messages; first+=(long) sb->depth * sb->nclients) {
+		for (n=0, i=first; n<sb->depth && i<sb->messages; n++, i+=sb->nclients) {
+			stream_job(sb, i, &jobs[n]);
+			clock_gettime(CLOCK_MONOTONIC, &t0[n]);
+			batcher_submit(sb->batcher, &jobs[n]);
+		}
+		for (k=0, i=first; k<n; k++, i+=sb->nclients) {
+			batcher_wait(sb->batcher, &jobs[k]);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			sb->ns[i] = elapsed_ns(&t0[k], &t1);
+		}
+	}
+	return NULL;
+}
+
+// Run every message through sb's path, on nclients threads. Returns the seconds taken.
+static double stream_pass(struct STREAMBENCH *sb) {
+	struct STREAMCLIENT *clients = calloc(sb->nclients, sizeof(struct STREAMCLIENT));
+	int i, started = 0;
+	double start = now_seconds();
+	for (i=0; clients != NULL && i<sb->nclients; i++) {
+		clients[i].bench = sb;
+		clients[i].id = i;
+		if (pthread_create(&clients[i].thread, NULL, stream_client, &clients[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+	for (i=0; i<started; i++) {
+		pthread_join(clients[i].thread, NULL);
+	}
+	if (started < sb->nclients) {
+		// Run the rest on this thread.
+		struct STREAMCLIENT c = { sb, 0, 0 };
+		for (i=started; i<sb->nclients; i++) {
+			c.id = i;
+			stream_client(&c);
+		}
+	}
+	free(clients);
+	return now_seconds() - start;
+}
+
+static void stream_report(const char *name, struct STREAMBENCH *sb, double seconds) {
+	qsort(sb->ns, sb->messages, sizeof(long), compare_ns);
+	printf("%-10s %9.2f MB/s %9.2f Kmsg/s %8ld %8ld %8ld\n", name,
+			sb->messages * sb->size / seconds / 1e6, sb->messages / seconds / 1e3,
+			sb->ns[sb->messages / 2], sb->ns[sb->messages * 99 / 100], sb->ns[sb->messages * 999 / 1000]);
+}
+
+void bench_streams(long messages, long size, int nclients, int depth, int nthreads, long delay_us) {
+	struct STREAMBENCH sb;
+	unsigned char *expected;
+	long i;
+	size = (size + 7) / 8 * 8;
+	if (messages <= 0 || size <= 0 || size > 8 * DES_SMALL_BLOCKS * 8 || nclients <= 0
+			|| depth <= 0 || depth > STREAM_MAX_DEPTH) {
+		printf("-size must be 1 to %d bytes, -depth 1 to %d, -messages and -clients positive\n",
+				8 * DES_SMALL_BLOCKS * 8, STREAM_MAX_DEPTH);
+		return;
+	}
+	sb.batcher = NULL;
+	sb.messages = messages;
+	sb.size = size;
+	sb.nclients = nclients;
+	sb.depth = depth;
+	sb.keys = malloc(STREAM_KEYS * sizeof(DESKEY));
+	sb.bufs = malloc(messages * size);
+	sb.ns = malloc(messages * sizeof(long));
+	expected = malloc(messages * size);
+	if (sb.keys == NULL || sb.bufs == NULL || sb.ns == NULL || expected == NULL) {
+		printf("Out of memory\n");
+		free(sb.keys);
+		free(sb.bufs);
+		free(sb.ns);
+		free(expected);
+		return;
+	}
+	for (i=0; i<STREAM_KEYS; i++) {
+		des_key_init(&sb.keys[i], (KEYTYPE) i * 0x9e3779b97f4a7 & 0xffffffffffffff);
+	}
+	for (i=0; i<messages * size; i++) {
+		sb.bufs[i] = (unsigned char) (i * 131 >> 3);
+	}
+	table_init();
+	memcpy(expected, sb.bufs, messages * size);
+	printf("%ld messages of %ld bytes, %d clients, %d in flight each\n", messages, size, nclients, depth);
+	printf("path              throughput      messages   p50 ns   p99 ns  p999 ns\n");
+	double alone = stream_pass(&sb);
+	stream_report("alone", &sb, alone);
+
+	unsigned char *batched = sb.bufs;
+	sb.bufs = expected;
+	expected = batched;
+	sb.batcher = batcher_start(nthreads, delay_us);
+	if (sb.batcher == NULL) {
+		printf("Couldn't start the batcher\n");
+	} else {
+		double seconds = stream_pass(&sb);
+		stream_report("batched", &sb, seconds);
+		printf("%llu batches, %.1f lanes each, max delay %ld us, %d threads\n",
+				(unsigned long long) sb.batcher->batches,
+				sb.batcher->batches ? (double) sb.batcher->lanes / sb.batcher->batches : 0.0,
+				delay_us, sb.batcher->nthreads);
+		batcher_stop(sb.batcher);
+		printf("%s\n", memcmp(sb.bufs, expected, messages * size) ? "MISMATCH" : "results match");
+	}
+	free(sb.keys);
+	free(sb.bufs);
+	free(sb.ns);
+	free(expected);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Tuning
+/////////////////////////////////////////////////////////////////////////////
+
+// The first time des runs on a host, and whenever "des -tune" is run, it
+// spends a few hundred milliseconds timing the settings that depend on the
+// machine: the table engine's interleave, the SIMD level for each message
+// size class, and the number of threads and the chunk size for -batch. The
+// winners go into a per-host profile, ~/.des_tune.<hostname>, one "name
+// values" line each, which later runs just read. The profile also records the
+// number of CPUs and the widest SIMD level the CPU has; if either no longer
+// matches, the host is tuned again.
+#define TUNE_BYTES (16 << 20)      // buffer for the thread and chunk size probes
+#define TUNE_MIN_GAIN 1.05         // more threads only if at least this much faster
+
+static const size_t tune_class_bytes[SIZE_CLASSES] = { 1 << 10, 64 << 10, 1 << 20 };
+static const size_t tune_chunks[] = { 256 << 10, 1 << 20, 4 << 20 };
+
+// ~/<name>.<hostname>, for files that only hold for this machine.
+void host_file_path(char *path, size_t size, const char *name) {
+	char host[256];
+	const char *home = getenv("HOME");
+	if (gethostname(host, sizeof(host)) != 0) {
+		strcpy(host, "localhost");
+	}
+	host[sizeof(host) - 1] = '\0';
+	snprintf(path, size, "%s/%s.%s", home != NULL ? home : ".", name, host);
+}
+
+void tune_profile_path(char *path, size_t size) {
+	host_file_path(path, size, ".des_tune");
+}
+
+// Seconds to encrypt about a megabyte as messages of "bytes" bytes.
+static double tune_time_engine(unsigned char *buf, size_t bytes, int level) {
+	size_t reps = (1 << 20) / bytes, r;
+	double start = now_seconds();
+	for (r=0; r<reps; r++) {
+		simd_crypt_level((BLOCKTYPE *) buf, bytes / 8, 0, level);
+	}
+	return now_seconds() - start;
+}
+
+// Seconds for a pool of "threads" workers to encrypt TUNE_BYTES bytes cut
+// into "chunk" byte tasks, or 0 if the pool won't start.
+static double tune_time_pool(unsigned char *buf, int threads, size_t chunk) {
+	static struct SCALINGCHUNK chunks[TUNE_BYTES / (256 << 10)];
+	struct POOL *pool = pool_start(threads);
+	int n = TUNE_BYTES / chunk, i;
+	if (pool == NULL) {
+		return 0;
+	}
+	double start = now_seconds();
+	for (i=0; i<n; i++) {
+		chunks[i].buf = buf + (size_t) i * chunk;
+		chunks[i].len = chunk;
+		chunks[i].touch = 0;
+		pool_submit(pool, scaling_chunk, &chunks[i]);
+	}
+	pool_wait(pool);
+	double t = now_seconds() - start;
+	pool_stop(pool);
+	return t;
+}
+
+// Time the candidates and set the winners.
+void tune_probe(void) {
+	unsigned char *buf = alloc_block_storage(TUNE_BYTES);
+	int ncpus = default_threads(), c, level, threads, i;
+	table_calibrate();
+	if (buf == NULL) {
+		return;
+	}
+	memset(buf, 0x5a, TUNE_BYTES);
+	for (c=0; c<SIZE_CLASSES; c++) {
+		double best = 0;
+		for (level=SIMD_NONE; level<=simd_engine; level++) {
+			double t = tune_time_engine(buf, tune_class_bytes[c], level);
+			if (level == SIMD_NONE || t < best) {
+				best = t;
+				class_engine[c] = level;
+			}
+		}
+	}
+	double best = 0;
+	batch_threads = 1;
+	for (threads=1; ; threads = threads*2 < ncpus ? threads*2 : ncpus) {
+		double t = tune_time_pool(buf, threads, BATCH_CHUNK);
+		if (t > 0 && (best == 0 || t * TUNE_MIN_GAIN < best)) {
+			best = t;
+			batch_threads = threads;
+		}
+		if (threads >= ncpus) {
+			break;
+		}
+	}
+	best = 0;
+	for (i=0; i<(int) (sizeof(tune_chunks) / sizeof(tune_chunks[0])); i++) {
+		double t = tune_time_pool(buf, batch_threads, tune_chunks[i]);
+		if (t > 0 && (best == 0 || t < best)) {
+			best = t;
+			batch_chunk = tune_chunks[i];
+		}
+	}
+	free_block_storage(buf, TUNE_BYTES);
+}
+
+void tune_save(const char *path) {
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		return;
+	}
+	fprintf(fp, "ncpus %d\nsimd %d\ninterleave %d\nengine %d %d %d\nthreads %d\nchunk %zu\n",
+			default_threads(), simd_engine, table_interleave,
+			class_engine[0], class_engine[1], class_engine[2], batch_threads, batch_chunk);
+	fclose(fp);
+}
+
+// Read the profile. Returns 0 if it's there, was made on this hardware and
+// holds sensible values. A value that's out of range (a damaged or hand-edited
+// profile) isn't used: that setting gets its built-in default, and -1 is
+// returned so that des tunes the host again.
+int tune_load(const char *path) {
+	int ncpus, simd, interleave, engine[SIZE_CLASSES], threads, c;
+	size_t chunk;
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	int n = fscanf(fp, "ncpus %d simd %d interleave %d engine %d %d %d threads %d chunk %zu",
+			&ncpus, &simd, &interleave, &engine[0], &engine[1], &engine[2], &threads, &chunk);
+	fclose(fp);
+	if (n != 8 || ncpus != default_threads() || simd != simd_engine) {
+		return -1;
+	}
+	int result = 0;
+	if (interleave == 1 || interleave == 2 || interleave == 4 || interleave == 8) {
+		table_interleave = interleave;
+	} else {
+		table_interleave = 8;
+		result = -1;
+	}
+	for (c=0; c<SIZE_CLASSES; c++) {
+		if (engine[c] >= SIMD_NONE && engine[c] <= simd_engine) {
+			class_engine[c] = engine[c];
+		} else {
+			class_engine[c] = simd_engine;
+			result = -1;
+		}
+	}
+	if (threads >= 1) {
+		batch_threads = threads;
+	} else {
+		batch_threads = 0;
+		result = -1;
+	}
+	if (chunk >= 4096 && chunk % 8 == 0) {
+		batch_chunk = chunk;
+	} else {
+		batch_chunk = BATCH_CHUNK;
+		result = -1;
+	}
+	return result;
+}
+
+// Load this host's profile, or make it if there isn't one (or force is set).
+void tune_setup(int force) {
+	char path[1024];
+	table_init();
+	simd_init();
+	tune_profile_path(path, sizeof(path));
+	if (!force && tune_load(path) == 0) {
+		return;
+	}
+	tune_probe();
+	tune_save(path);
+}
+
+// Set up the engines for a program that uses DES.c as a library, and so
+// never runs main's tune_setup: the widest SIMD engine the CPU has, and the
+// tuned choices if "des -tune" has made a profile on this host (it isn't
+// made here, tuning takes a while). batcher_start and des_reader_open call
+// this; calling it again does nothing.
+static pthread_once_t des_init_once = PTHREAD_ONCE_INIT;
+
+static void des_init_engines(void) {
+	char path[1024];
+	table_init();
+	simd_init();
+	tune_profile_path(path, sizeof(path));
+	tune_load(path);
+}
+
+void des_init(void) {
+	pthread_once(&des_init_once, des_init_engines);
+}
+
+// "des -tune": tune again and show the result.
+void tune_report(void) {
+	static const char *levels[] = { "table", "avx2", "avx512vbmi" };
+	char path[1024];
+	tune_profile_path(path, sizeof(path));
+	printf("profile        %s\n", path);
+	printf("interleave     %d\n", table_interleave);
+	printf("engine <4K     %s\n", levels[class_engine[0]]);
+	printf("engine <1M     %s\n", levels[class_engine[1]]);
+	printf("engine larger  %s\n", levels[class_engine[2]]);
+	printf("batch threads  %d\n", batch_threads);
+	printf("batch chunk    %zu KB\n", batch_chunk >> 10);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Meet-in-the-middle
+/////////////////////////////////////////////////////////////////////////////
+
+// "des -mitm BITS" shows why double DES is hardly stronger than DES. Two
+// random keys k1, k2 below 2^BITS encrypt two random plaintexts twice,
+// C = E_k2(E_k1(P)), and the attack recovers them from the two pairs with
+// about 2 * 2^BITS encryptions instead of 2^(2*BITS):
+//   1. E_k1(P1) for every k1,
+//   2. D_k2(C1) for every k2,
+//   3. join the two on the middle value, and check each match on P2, C2.
+// Steps 1 and 2 radix-partition their results by the top bits of the middle
+// value as they go, and keep each one in 8 bytes: the next 32 bits and the
+// key. Step 3 then takes one partition at a time and joins it through an
+// open-addressing hash table that's small enough to stay in the cache.
+// The partitions live in anonymous memory, or, when they'd need more than
+// -mem MB (default half the RAM), in memory-mapped files in -spill DIR
+// (default the current directory) that the kernel can page out.
+#define MITM_MAX_BITS 31
+#define MITM_PARTITION_BITS 15      // aim for about 2^15 entries per partition
+#define MITM_TASK_KEYS (1 << 14)
+#define MITM_EMPTY 0xffffffffu      // no key is this big
+
+struct MITMENTRY {
+	uint32_t tag;           // the 32 bits of the middle value after the partition bits
+	uint32_t key;
+};
+
+struct MITMSIDE {
+	struct MITMENTRY *entries;      // partition p starts at entries + p * cap
+	size_t bytes;
+	size_t *fill;                   // entries in each partition so far
+};
+
+struct MITM {
+	int bits;
+	int pbits;                      // the partition is the top pbits of the middle value
+	size_t nparts;
+	size_t cap;                     // room in each partition
+	BLOCKTYPE p[2], c[2];           // the known pairs
+	struct MITMSIDE side[2];        // E_k1(P1) and D_k2(C1)
+	int overflow;
+	uint64_t candidates;            // matches on the stored bits
+	pthread_mutex_t lock;
+	int found;
+	uint32_t k1, k2;
+};
+
+struct MITMTASK {
+	struct MITM *m;
+	int side;
+	size_t first;           // keys (steps 1, 2) or partitions (step 3)
+	size_t count;
+};
+
+// Encrypt (or decrypt) one block under one key of the reduced key space.
+BLOCKTYPE mitm_crypt(uint32_t key, BLOCKTYPE b, int decrypting) {
+	uint64_t subkeys[16];
+	unsigned char enc[16][8], dec[16][8];
+	unsigned char (*s)[8] = decrypting ? dec : enc;
+	key_schedule(key, subkeys);
+	table_cut_subkeys(subkeys, enc, dec);
+	table_crypt_keys(&b, 1, &s);
+	return b;
+}
+
+static inline size_t mitm_partition(struct MITM *m, BLOCKTYPE x) {
+	return m->pbits ? (size_t) (x >> (64 - m->pbits)) : 0;
+}
+
+static inline uint32_t mitm_tag(struct MITM *m, BLOCKTYPE x) {
+	return (uint32_t) ((x << m->pbits) >> 32);
+}
+
+// Steps 1 and 2 for the keys first .. first+count-1: compute the middle
+// values KEY_BATCH keys at a time, count them per partition, reserve that much of
+// each partition with one atomic add, and scatter.
+static void mitm_fill(void *arg) {
+	struct MITMTASK *task = arg;
+	struct MITM *m = task->m;
+	struct MITMSIDE *side = &m->side[task->side];
+	BLOCKTYPE *x = malloc(task->count * sizeof(BLOCKTYPE));
+	size_t *hist = calloc(m->nparts, sizeof(size_t));
+	KEYTYPE keys[KEY_BATCH];
+	unsigned char sched[KEY_BATCH][16][8];
+	unsigned char (*s[KEY_BATCH])[8];
+	size_t i, j;
+	if (x == NULL || hist == NULL) {
+		m->overflow = 1;
+		free(x);
+		free(hist);
+		return;
+	}
+	for (i=0; i<task->count; i+=KEY_BATCH) {
+		size_t n = task->count - i < KEY_BATCH ? task->count - i : KEY_BATCH;
+		for (j=0; j<n; j++) {
+			keys[j] = task->first + i + j;
+			s[j] = sched[j];
+			x[i+j] = task->side ? m->c[0] : m->p[0];
+		}
+		if (task->side) {
+			key_schedule_bulk_table(keys, (int) n, NULL, sched);
+		} else {
+			key_schedule_bulk_table(keys, (int) n, sched, NULL);
+		}
+		simd_crypt_lanes(x + i, n, s);
+	}
+	for (i=0; i<task->count; i++) {
+		hist[mitm_partition(m, x[i])]++;
+	}
+	for (i=0; i<m->nparts; i++) {
+		if (hist[i] > 0) {
+			hist[i] = __sync_fetch_and_add(&side->fill[i], hist[i]);
+		}
+	}
+	for (i=0; i<task->count; i++) {
+		size_t p = mitm_partition(m, x[i]), slot = hist[p]++;
+		if (slot >= m->cap) {
+			m->overflow = 1;
+			continue;
+		}
+		struct MITMENTRY *e = &side->entries[p * m->cap + slot];
+		e->tag = mitm_tag(m, x[i]);
+		e->key = (uint32_t) (task->first + i);
+	}
+	free(x);
+	free(hist);
+}
+
+// Step 3 for the partitions first .. first+count-1.
+static void mitm_join(void *arg) {
+	struct MITMTASK *task = arg;
+	struct MITM *m = task->m;
+	size_t size = 1, p, i;
+	while (size < 2 * m->cap) {
+		size *= 2;
+	}
+	struct MITMENTRY *table = malloc(size * sizeof(struct MITMENTRY));
+	uint64_t candidates = 0;
+	if (table == NULL) {
+		m->overflow = 1;
+		return;
+	}
+	for (p=task->first; p<task->first+task->count; p++) {
+		struct MITMENTRY *enc = m->side[0].entries + p * m->cap;
+		struct MITMENTRY *dec = m->side[1].entries + p * m->cap;
+		size_t nenc = m->side[0].fill[p] < m->cap ? m->side[0].fill[p] : m->cap;
+		size_t ndec = m->side[1].fill[p] < m->cap ? m->side[1].fill[p] : m->cap;
+		memset(table, 0xff, size * sizeof(struct MITMENTRY));
+		// The tags are already random, so their low bits make a fine hash.
+		for (i=0; i<nenc; i++) {
+			size_t h = enc[i].tag & (size - 1);
+			while (table[h].key != MITM_EMPTY) {
+				h = (h + 1) & (size - 1);
+			}
+			table[h] = enc[i];
+		}
+		for (i=0; i<ndec; i++) {
+			size_t h = dec[i].tag & (size - 1);
+			for (; table[h].key != MITM_EMPTY; h = (h + 1) & (size - 1)) {
+				if (table[h].tag != dec[i].tag) {
+					continue;
+				}
+				uint32_t k1 = table[h].key, k2 = dec[i].key;
+				candidates++;
+				if (mitm_crypt(k1, m->p[0], 0) == mitm_crypt(k2, m->c[0], 1)
+						&& mitm_crypt(k2, mitm_crypt(k1, m->p[1], 0), 0) == m->c[1]) {
+					pthread_mutex_lock(&m->lock);
+					m->found++;
+					m->k1 = k1;
+					m->k2 = k2;
+					pthread_mutex_unlock(&m->lock);
+				}
+			}
+		}
+	}
+	__sync_fetch_and_add(&m->candidates, candidates);
+	free(table);
+}
+
+// Room for one side's partitions: anonymous memory, or a file in dir that's
+// unlinked as soon as it's mapped. bytes is a whole number of huge pages, so
+// both are mappings and free_block_storage can release either.
+static struct MITMENTRY *mitm_alloc(size_t bytes, const char *dir) {
+	if (dir == NULL) {
+		return alloc_block_storage(bytes);
+	}
+#ifdef __linux__
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/des-mitm-XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		return NULL;
+	}
+	unlink(path);
+	size_t rounded = (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	void *p = ftruncate(fd, (off_t) rounded) == 0
+		? mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+#else
+	return NULL;
+#endif
+}
+
+// Run the steps on the pool; returns the seconds it took.
+static double mitm_run(struct POOL *pool, struct MITM *m, int step) {
+	size_t nkeys = (size_t) 1 << m->bits, i;
+	size_t ntasks = step < 2 ? (nkeys + MITM_TASK_KEYS - 1) / MITM_TASK_KEYS : m->nparts;
+	struct MITMTASK *tasks = malloc(ntasks * sizeof(struct MITMTASK));
+	double start = now_seconds();
+	if (tasks == NULL) {
+		m->overflow = 1;
+		return 0;
+	}
+	for (i=0; i<ntasks; i++) {
+		tasks[i].m = m;
+		tasks[i].side = step;
+		if (step < 2) {
+			tasks[i].first = i * MITM_TASK_KEYS;
+			tasks[i].count = nkeys - tasks[i].first < MITM_TASK_KEYS ? nkeys - tasks[i].first : MITM_TASK_KEYS;
+			pool_submit(pool, mitm_fill, &tasks[i]);
+		} else {
+			tasks[i].first = i;
+			tasks[i].count = 1;
+			pool_submit(pool, mitm_join, &tasks[i]);
+		}
+	}
+	pool_wait(pool);
+	free(tasks);
+	return now_seconds() - start;
+}
+
+static uint64_t mitm_random(void) {
+	uint64_t r = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, &r, sizeof(r)) != sizeof(r)) {
+		r = (uint64_t) time(NULL) * 0x9E3779B97F4A7C15ull ^ (uint64_t) getpid();
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return r;
+}
+
+void mitm(int bits, int nthreads, size_t mem, const char *spill_dir) {
+	struct MITM m;
+	int step, s;
+	memset(&m, 0, sizeof(m));
+	table_init();
+	if (bits < 1 || bits > MITM_MAX_BITS) {
+		printf("-mitm needs a number of key bits from 1 to %d\n", MITM_MAX_BITS);
+		return;
+	}
+	m.bits = bits;
+	m.pbits = bits > MITM_PARTITION_BITS ? bits - MITM_PARTITION_BITS : 0;
+	m.nparts = (size_t) 1 << m.pbits;
+	// The partitions fill up evenly: with 2^15 entries on average, an eighth
+	// more is over 20 standard deviations of slack, so one never overflows
+	// in practice. With a single partition there's nothing to even out.
+	m.cap = ((size_t) 1 << bits) / m.nparts;
+	if (m.pbits > 0) {
+		m.cap += m.cap / 8;
+	}
+	size_t bytes = m.nparts * m.cap * sizeof(struct MITMENTRY);
+	int spill = 2 * bytes > mem;
+	pthread_mutex_init(&m.lock, NULL);
+
+	uint32_t mask = (uint32_t) (((uint64_t) 1 << bits) - 1);
+	uint32_t k1 = (uint32_t) mitm_random() & mask, k2 = (uint32_t) mitm_random() & mask;
+	for (s=0; s<2; s++) {
+		m.p[s] = mitm_random();
+		m.c[s] = mitm_crypt(k2, mitm_crypt(k1, m.p[s], 0), 0);
+	}
+
+	printf("mitm: 2^%d keys per half, %zu partitions, %.1f MB of tables (%zu bytes/key, x2 per key bit)%s\n",
+			bits, m.nparts, 2 * bytes / 1e6, 2 * bytes >> bits, spill ? ", spilled to disk" : "");
+	struct POOL *pool = pool_start(nthreads);
+	size_t mapped = (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	for (s=0; s<2; s++) {
+		m.side[s].bytes = bytes;
+		m.side[s].entries = mitm_alloc(mapped, spill ? (spill_dir != NULL ? spill_dir : ".") : NULL);
+		m.side[s].fill = calloc(m.nparts, sizeof(size_t));
+	}
+	if (pool == NULL || m.side[0].entries == NULL || m.side[1].entries == NULL
+			|| m.side[0].fill == NULL || m.side[1].fill == NULL) {
+		printf("mitm: not enough memory\n");
+	} else {
+		static const char *names[] = { "encrypt P1", "decrypt C1", "join" };
+		for (step=0; step<3 && !m.overflow; step++) {
+			double t = mitm_run(pool, &m, step);
+			if (step < 2) {
+				printf("%-11s %10zu keys %8.2f s %8.3f Mkeys/s\n", names[step], (size_t) 1 << bits, t, ((size_t) 1 << bits) / t / 1e6);
+			} else {
+				printf("%-11s %10llu candidates %3.2f s\n", names[step], (unsigned long long) m.candidates, t);
+			}
+		}
+		if (m.overflow) {
+			printf("mitm: a partition overflowed or memory ran out\n");
+		} else if (m.found == 0) {
+			printf("no key pair found (the keys were %x, %x)\n", k1, k2);
+		} else {
+			printf("found k1=%x k2=%x%s (%d pairs fit)\n", m.k1, m.k2,
+					m.k1 == k1 && m.k2 == k2 ? ", the right keys" : "", m.found);
+		}
+	}
+	if (pool != NULL) {
+		pool_stop(pool);
+	}
+	for (s=0; s<2; s++) {
+		free_block_storage(m.side[s].entries, mapped);
+		free(m.side[s].fill);
+	}
+	pthread_mutex_destroy(&m.lock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Self-check
+/////////////////////////////////////////////////////////////////////////////
+
+// "des -check" is the gate for the fast paths. It
+//   1. runs published known-answer vectors through des_enc, des_dec and
+//      every engine,
+//   2. encrypts and decrypts random blocks, and random messages of every
+//      length 8k+t for t from 0 to 8 (so every case of pad_last_block comes
+//      up), under random keys, with every engine, the CTR keystream at every
+//      engine level and from the -prefetch ring, and every message path
+//      (in memory, -mac, -armor, -z, -checkpoint and -batch among them) in
+//      ECB and CTR mode, and compares them bit for bit with des_enc/des_dec,
+//   3. counts the allocations made by the in-place path, which must be none
+//      (only in the des_alloc_check build, see des_alloc_check.c),
+//   4. times each engine and compares it with a per-host baseline,
+//      ~/.des_check.<hostname>, failing if one has got slower by more than
+//      -threshold percent (default CHECK_THRESHOLD). -save writes the
+//      baseline, and has to be given once first: with no baseline the check
+//      fails. -baseline FILE uses another file.
+// It prints each failure and returns 1 if there was any. -seed N repeats the
+// random inputs of an earlier run.
+#define CHECK_KEYS 4
+#define CHECK_BLOCKS (3*64 + 13)        // full batches for every engine, and a tail
+#define CHECK_LANES (4*64)
+#define CHECK_THRESHOLD 25
+#define CHECK_PERF_BYTES (256 << 10)
+#define CHECK_PERF_SECONDS 0.05
+
+// Published vectors, with the key as 64 bits including the parity bits.
+// The blocks are the values des_enc works on, bit 1 the most significant.
+struct KAT {
+	uint64_t key, plain, cipher;
+};
+
+static const struct KAT check_kats[] = {
+	{ 0x133457799BBCDFF1ull, 0x0123456789ABCDEFull, 0x85E813540F0AB405ull },  // Grabbe's example
+	{ 0x0E329232EA6D0D73ull, 0x8787878787878787ull, 0x0000000000000000ull },
+	{ 0x0123456789ABCDEFull, 0x4E6F772069732074ull, 0x3FA40E8A984D4815ull },  // FIPS 81, "Now is t"
+	{ 0x0101010101010101ull, 0x8000000000000000ull, 0x95F8A5E5DD31D900ull },  // SP 800-17 tables
+	{ 0x0101010101010101ull, 0x0000000000000001ull, 0x166B40B44ABA4BD6ull },
+	{ 0x8001010101010101ull, 0x0000000000000000ull, 0x95A8D72813DAA94Dull },
+	{ 0x7CA110454A1A6E57ull, 0x01A1D6D039776742ull, 0x690F5B0D9A26939Bull },
+	{ 0x0131D9619DC1376Eull, 0x5CD54CA83DEF57DAull, 0x7A389D10354BD271ull },
+};
+
+#define CHECK_ENGINES 6
+static const char *check_engine_names[CHECK_ENGINES] = { "des_enc", "table", "avx2", "avx512vbmi", "lanes", "lanes-avx2" };
+
+#define CHECK_PATHS 10
+static const char *check_path_names[CHECK_PATHS] = {
+	"list", "inplace", "small", "batcher", "reader", "ring", "mac", "armor", "z", "stream"
+};
+
+static int check_failures;
+
+static uint64_t check_rng;
+
+static uint64_t check_random(void) {
+	check_rng ^= check_rng << 13;       // xorshift64
+	check_rng ^= check_rng >> 7;
+	check_rng ^= check_rng << 17;
+	return check_rng;
+}
+
+static void check_fail(const char *what, const char *name, KEYTYPE key, int mode, long len) {
+	printf("FAIL %-8s %-10s key %014llx %s", what, name, (unsigned long long) key, mode == DES_CTR ? "ctr" : "ecb");
+	if (len >= 0) {
+		printf(" length %ld", len);
+	}
+	printf("\n");
+	check_failures++;
+}
+
+// Make key the current one, for des_enc and the engines.
+static void check_set_key(KEYTYPE key) {
+	generateSubKeys(key);
+	table_load_subkeys();
+}
+
+// Encrypt or decrypt n blocks in place with engine e and the current key.
+// Returns -1 if this CPU doesn't have the engine.
+static int check_engine(int e, BLOCKTYPE *blocks, size_t n, int decrypting) {
+	unsigned char (*lanes[CHECK_LANES])[8];
+	unsigned char copy[16][8];
+	size_t i;
+	switch (e) {
+	case 0:
+		for (i=0; i<n; i++) {
+			blocks[i] = decrypting ? des_dec(blocks[i]) : des_enc(blocks[i]);
+		}
+		return 0;
+	case 1:
+		table_crypt(blocks, n, decrypting);
+		return 0;
+	case 2:
+	case 3:
+		if (simd_engine < (e == 2 ? SIMD_AVX2 : SIMD_VBMI)) {
+			return -1;
+		}
+		simd_crypt_level(blocks, n, decrypting, e == 2 ? SIMD_AVX2 : SIMD_VBMI);
+		return 0;
+	default:
+		if (e == 5 && simd_engine < SIMD_AVX2) {
+			return -1;
+		}
+		// Every other lane gets a copy of the schedule, so the engine
+		// can't tell that they're all the same key.
+		memcpy(copy, decrypting ? dec_schedule : enc_schedule, sizeof(copy));
+		for (i=0; i<n; i+=CHECK_LANES) {
+			size_t k = n - i < CHECK_LANES ? n - i : CHECK_LANES, j;
+			for (j=0; j<k; j++) {
+				lanes[j] = j % 2 ? copy : decrypting ? dec_schedule : enc_schedule;
+			}
+			simd_crypt_lanes_level(blocks + i, k, lanes, e == 5 ? SIMD_AVX2 : simd_engine);
+		}
+		return 0;
+	}
+}
+
+// Every engine on every known-answer vector, in a batch of copies so the
+// SIMD engines see full batches.
+static void check_kat(void) {
+	BLOCKTYPE blocks[CHECK_BLOCKS];
+	size_t k, i;
+	int e;
+	for (k=0; k<sizeof(check_kats) / sizeof(check_kats[0]); k++) {
+		const struct KAT *kat = &check_kats[k];
+		KEYTYPE key = key_without_parity(kat->key);
+		check_set_key(key);
+		for (e=0; e<CHECK_ENGINES; e++) {
+			int bad = 0;
+			for (i=0; i<CHECK_BLOCKS; i++) {
+				blocks[i] = kat->plain;
+			}
+			if (check_engine(e, blocks, CHECK_BLOCKS, 0) != 0) {
+				continue;
+			}
+			for (i=0; i<CHECK_BLOCKS; i++) {
+				bad |= blocks[i] != kat->cipher;
+			}
+			check_engine(e, blocks, CHECK_BLOCKS, 1);
+			for (i=0; i<CHECK_BLOCKS; i++) {
+				bad |= blocks[i] != kat->plain;
+			}
+			if (bad) {
+				check_fail("kat", check_engine_names[e], key, DES_ECB, -1);
+			}
+		}
+	}
+}
+
+// Random blocks through every engine, against des_enc and des_dec.
+static void check_engines(KEYTYPE key) {
+	BLOCKTYPE plain[CHECK_BLOCKS], cipher[CHECK_BLOCKS], blocks[CHECK_BLOCKS];
+	size_t i;
+	int e;
+	for (i=0; i<CHECK_BLOCKS; i++) {
+		plain[i] = check_random();
+		cipher[i] = des_enc(plain[i]);
+		if (des_dec(cipher[i]) != plain[i]) {
+			check_fail("engine", "des_dec", key, DES_ECB, -1);
+			return;
+		}
+	}
+	for (e=1; e<CHECK_ENGINES; e++) {
+		memcpy(blocks, plain, sizeof(blocks));
+		if (check_engine(e, blocks, CHECK_BLOCKS, 0) != 0) {
+			continue;
+		}
+		int bad = memcmp(blocks, cipher, sizeof(blocks)) != 0;
+		check_engine(e, blocks, CHECK_BLOCKS, 1);
+		if (bad || memcmp(blocks, plain, sizeof(blocks)) != 0) {
+			check_fail("engine", check_engine_names[e], key, DES_ECB, -1);
+		}
+	}
+}
+
+// The lane engines with two keys mixed at random over the lanes, so a lane
+// that ends up with another lane's key shows, against the table engine one
+// block at a time: on the widest engine the CPU has, and on AVX2.
+static void check_lanes(KEYTYPE key) {
+	const int levels[] = { simd_engine, SIMD_AVX2 };
+	static const char *names[] = { "lanes", "lanes-avx2" };
+	unsigned char enc[2][16][8], dec[2][16][8];
+	unsigned char (*lanes[CHECK_BLOCKS])[8];
+	BLOCKTYPE plain[CHECK_BLOCKS], cipher[CHECK_BLOCKS], blocks[CHECK_BLOCKS];
+	KEYTYPE keys[2] = { key, check_random() & 0x00FFFFFFFFFFFFFFull };
+	int which[CHECK_BLOCKS], l;
+	size_t i;
+	key_schedule_bulk_table(keys, 2, enc, dec);
+	for (i=0; i<CHECK_BLOCKS; i++) {
+		plain[i] = cipher[i] = check_random();
+		which[i] = check_random() & 1;
+		lanes[i] = enc[which[i]];
+		table_crypt_keys(&cipher[i], 1, &lanes[i]);
+	}
+	for (l=0; l<2; l++) {
+		int level = levels[l];
+		if (level > simd_engine) {
+			continue;
+		}
+		memcpy(blocks, plain, sizeof(blocks));
+		for (i=0; i<CHECK_BLOCKS; i++) {
+			lanes[i] = enc[which[i]];
+		}
+		simd_crypt_lanes_level(blocks, CHECK_BLOCKS, lanes, level);
+		int bad = memcmp(blocks, cipher, sizeof(blocks)) != 0;
+		for (i=0; i<CHECK_BLOCKS; i++) {
+			lanes[i] = dec[which[i]];
+		}
+		simd_crypt_lanes_level(blocks, CHECK_BLOCKS, lanes, level);
+		if (bad || memcmp(blocks, plain, sizeof(blocks)) != 0) {
+			check_fail("engine", names[l], key, DES_ECB, -1);
+		}
+	}
+}
+
+// The CTR keystream at every engine level, and through a keystream_start
+// ring in pieces of uneven sizes, against des_enc of the counters. The ring
+// is the smallest there is, so the pieces cross segments and wrap around.
+static void check_keystream(KEYTYPE key) {
+	static const int levels[] = { SIMD_NONE, SIMD_AVX2, SIMD_VBMI };
+	BLOCKTYPE want[5*KS_SEGMENT + 13], got[5*KS_SEGMENT + 13];
+	BLOCKTYPE base = check_random();
+	size_t n = sizeof(want) / sizeof(want[0]), i, k;
+	int l;
+	for (i=0; i<n; i++) {
+		want[i] = des_enc(base + i);
+	}
+	for (l=0; l<3; l++) {
+		if (simd_engine < levels[l]) {
+			continue;
+		}
+		simd_keystream_level(got, base, CHECK_BLOCKS, levels[l]);
+		if (memcmp(got, want, CHECK_BLOCKS * sizeof(BLOCKTYPE)) != 0) {
+			check_fail("keystream", check_engine_names[l + 1], key, DES_CTR, -1);
+		}
+	}
+	struct KEYSTREAM *ring = keystream_start(base, 1, 1);
+	if (ring == NULL) {
+		check_fail("start", "ring", key, DES_CTR, -1);
+		return;
+	}
+	memset(got, 0, sizeof(got));
+	for (i=0; i<n; i+=k) {
+		k = 1 + check_random() % 100;
+		if (k > n - i) {
+			k = n - i;
+		}
+		keystream_xor(ring, got + i, k);
+	}
+	keystream_stop(ring);
+	if (memcmp(got, want, sizeof(got)) != 0) {
+		check_fail("keystream", "ring", key, DES_CTR, -1);
+	}
+}
+
+// The reference ciphertext of msg: pad_last_block's rule (zeros, then the
+// number of real bytes in the last byte) and des_enc one block at a time.
+// Returns its length.
+static size_t check_reference(int mode, const unsigned char *msg, size_t len, unsigned char *out) {
+	size_t padded = (len / 8 + 1) * 8, i;
+	memset(out, 0, padded);
+	memcpy(out, msg, len);
+	out[padded - 1] = (unsigned char) (len % 8);
+	for (i=0; i<padded/8; i++) {
+		BLOCKTYPE b;
+		memcpy(&b, out + 8*i, 8);
+		b = mode == DES_CTR ? b ^ des_enc((BLOCKTYPE) i) : des_enc(b);
+		memcpy(out + 8*i, &b, 8);
+	}
+	return padded;
+}
+
+// A stream to read len bytes from, for the list path's readers.
+static FILE *check_stream(const unsigned char *buf, size_t len) {
+	FILE *fp = tmpfile();
+	if (fp != NULL && (fwrite(buf, 1, len, fp) != len || fseek(fp, 0, SEEK_SET) != 0)) {
+		fclose(fp);
+		fp = NULL;
+	}
+	return fp;
+}
+
+// Copy a block list into buf, 8 bytes per block. Returns the bytes copied.
+static size_t check_list_bytes(BLOCKLIST list, unsigned char *buf) {
+	size_t n = 0;
+	for (; list != NULL; list = list->next, n += 8) {
+		memcpy(buf + n, &list->block, 8);
+	}
+	return n;
+}
+
+#define CHECK_PATH_MAX 32
+
+// Make a temporary file holding the len bytes at buf, and put its name in
+// path. Returns 0, or -1 (and no file).
+static int check_temp_file(char *path, const unsigned char *buf, size_t len) {
+	snprintf(path, CHECK_PATH_MAX, "/tmp/des_check.XXXXXX");
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		return -1;
+	}
+	int ok = len == 0 || write(fd, buf, len) == (ssize_t) len;
+	close(fd);
+	if (!ok) {
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+// Read the file at path into buf, which has room for max bytes. Returns its
+// length, or -1.
+static long check_read_file(const char *path, unsigned char *buf, size_t max) {
+	size_t n;
+	unsigned char *data = read_whole_file(path, &n, 0);
+	long result = data != NULL && n <= max ? (long) n : -1;
+	if (result > 0) {
+		memcpy(buf, data, n);
+	}
+	free(data);
+	return result;
+}
+
+// Encrypt msg with path p into ct, and decrypt the reference ciphertext
+// ref into pt. Return the two lengths, -1 for a failure, 1 if the path
+// doesn't take this message, or 2 if only the round trip can be checked
+// (then ct is left alone and pt is msg decrypted again).
+static int check_path(int p, int mode, const DESKEY *key, struct BATCHER *batcher,
+		const unsigned char *msg, size_t len, const unsigned char *ref, size_t reflen,
+		unsigned char *ct, long *ctlen, unsigned char *pt, long *ptlen) {
+	DESCTX ctx;
+	des_ctx_init(&ctx, mode);
+	*ctlen = *ptlen = -1;
+	if (p == 0) {
+		FILE *fp = check_stream(msg, len);
+		BLOCKLIST list = read_cleartext_message(fp);
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		if (list != NULL) {
+			list = mode == DES_CTR ? des_enc_CTR(list) : des_enc_ECB(list);
+			*ctlen = (long) check_list_bytes(list, ct);
+			free_block_storage(list, (len / 8 + 1) * sizeof(struct BLOCK));
+		}
+		fp = check_stream(ref, reflen);
+		list = read_encrypted_file(fp);
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		if (list != NULL) {
+			list = mode == DES_CTR ? des_dec_CTR(list) : des_dec_ECB(list);
+			*ptlen = des_unpadded_length(pt, check_list_bytes(list, pt));
+			free_block_storage(list, reflen / 8 * sizeof(struct BLOCK));
+		}
+	} else if (p == 1) {
+		memcpy(ct, msg, len);
+		*ctlen = des_encrypt_inplace(&ctx, ct, len, reflen);
+		des_ctx_init(&ctx, mode);
+		memcpy(pt, ref, reflen);
+		*ptlen = des_decrypt_inplace(&ctx, pt, reflen, reflen);
+	} else if (p == 2) {
+		if (len > DES_SMALL_MAX) {
+			return 1;
+		}
+		*ctlen = des_encrypt_small(&ctx, msg, len, ct);
+		des_ctx_init(&ctx, mode);
+		*ptlen = des_decrypt_small(&ctx, ref, reflen, pt);
+	} else if (p == 3) {
+		DESJOB job;
+		memset(&job, 0, sizeof(job));
+		job.mode = mode;
+		job.key = (DESKEY *) key;
+		memcpy(ct, msg, len);
+		job.buf = ct;
+		job.nblocks = des_pad_inplace(ct, len) / 8;
+		batcher_submit(batcher, &job);
+		batcher_wait(batcher, &job);
+		*ctlen = (long) (job.nblocks * 8);
+		memcpy(pt, ref, reflen);
+		job.buf = pt;
+		job.nblocks = reflen / 8;
+		job.decrypting = 1;
+		batcher_submit(batcher, &job);
+		batcher_wait(batcher, &job);
+		*ptlen = des_unpadded_length(pt, reflen);
+	} else if (p == 4) {
+		char path[CHECK_PATH_MAX];
+		if (check_temp_file(path, ref, reflen) != 0) {
+			return -1;
+		}
+		DESREADER *r = des_reader_open(path, mode);
+		if (r != NULL) {
+			long n = 0, got;
+			while ((got = des_reader_read(r, pt + n, 1000)) > 0) {
+				n += got;
+			}
+			*ptlen = got < 0 ? -1 : n;
+			des_reader_close(r);
+		}
+		unlink(path);
+		// The reader only decrypts; the encryption half is the in-place path's.
+		memcpy(ct, ref, reflen);
+		*ctlen = (long) reflen;
+	} else if (p == 5) {
+		// The CTR keystream ring: the list path takes it from ctr_keystream
+		// (as with -prefetch), the in-place path from ctx.keystream.
+		if (mode != DES_CTR) {
+			return 1;
+		}
+		FILE *fp = check_stream(msg, len);
+		BLOCKLIST list = read_cleartext_message(fp);
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		ctr_keystream = keystream_start(0, 1, 1);
+		if (list != NULL && ctr_keystream != NULL) {
+			list = des_enc_CTR(list);
+			*ctlen = (long) check_list_bytes(list, ct);
+		}
+		if (list != NULL) {
+			free_block_storage(list, (len / 8 + 1) * sizeof(struct BLOCK));
+		}
+		if (ctr_keystream != NULL) {
+			keystream_stop(ctr_keystream);
+			ctr_keystream = NULL;
+		}
+		ctx.keystream = keystream_start(0, 1, 1);
+		if (ctx.keystream != NULL) {
+			memcpy(pt, ref, reflen);
+			*ptlen = des_decrypt_inplace(&ctx, pt, reflen, reflen);
+			keystream_stop(ctx.keystream);
+		}
+	} else if (p == 6) {
+		// -mac: the reference with the tag after it, which has to check out,
+		// and not once a bit anywhere has been flipped. CTR takes its
+		// keystream from a ring, as it does with -prefetch.
+		static unsigned char forged[8*203];
+		long n;
+		ctx.mac = 1;
+		ctx.keystream = mode == DES_CTR ? keystream_start(0, 1, 1) : NULL;
+		memcpy(ct, msg, len);
+		n = des_encrypt_inplace(&ctx, ct, len, reflen + DES_TAG_SIZE);
+		if (ctx.keystream != NULL) {
+			keystream_stop(ctx.keystream);
+		}
+		if (n != (long) (reflen + DES_TAG_SIZE)) {
+			return -1;
+		}
+		*ctlen = n - DES_TAG_SIZE;
+		memcpy(pt, ct, n);
+		memcpy(forged, ct, n);
+		des_ctx_init(&ctx, mode);
+		ctx.mac = 1;
+		*ptlen = des_decrypt_inplace(&ctx, pt, n, n);
+		forged[check_random() % n] ^= (unsigned char) (1 << (check_random() % 8));
+		des_ctx_init(&ctx, mode);
+		ctx.mac = 1;
+		if (des_decrypt_inplace(&ctx, forged, n, n) >= 0) {
+			*ptlen = -1;
+		}
+	} else if (p == 7) {
+		// -armor, through files as crypt_file does it: the text decodes to
+		// the reference, and the reference as text decrypts to msg.
+		char in[CHECK_PATH_MAX], out[CHECK_PATH_MAX];
+		int armor = len % 2 ? ARMOR_HEX : ARMOR_BASE64;
+		if (check_temp_file(in, msg, len) != 0) {
+			return -1;
+		}
+		if (check_temp_file(out, NULL, 0) != 0) {
+			unlink(in);
+			return -1;
+		}
+		if (crypt_file(&ctx, in, out, 0, armor, 0) == 0) {
+			size_t n;
+			unsigned char *text = read_input_file(out, &n, 0, armor);
+			if (text != NULL && n <= reflen) {
+				memcpy(ct, text, n);
+				*ctlen = (long) n;
+			}
+			free(text);
+		}
+		memcpy(pt, ref, reflen);
+		des_ctx_init(&ctx, mode);
+		if (write_output_file(in, pt, reflen, armor, NULL) == 0
+				&& crypt_file(&ctx, in, out, 1, armor, 0) == 0) {
+			*ptlen = check_read_file(out, pt, reflen);
+		}
+		unlink(in);
+		unlink(out);
+	} else if (p == 8) {
+		// -z, with and without -mac. The compressed ciphertext has nothing
+		// to be compared with, so only the round trip is checked.
+		char in[CHECK_PATH_MAX], out[CHECK_PATH_MAX];
+		if (check_temp_file(in, msg, len) != 0) {
+			return -1;
+		}
+		if (check_temp_file(out, NULL, 0) != 0) {
+			unlink(in);
+			return -1;
+		}
+		ctx.mac = len % 2;
+		if (crypt_file(&ctx, in, out, 0, ARMOR_NONE, 1) == 0) {
+			des_ctx_init(&ctx, mode);
+			ctx.mac = len % 2;
+			if (crypt_file(&ctx, out, in, 1, ARMOR_NONE, 1) == 0) {
+				*ptlen = check_read_file(in, pt, len);
+			}
+		}
+		unlink(in);
+		unlink(out);
+		return 2;
+	} else {
+		// The checkpointed stream of -checkpoint, both ways.
+		char in[CHECK_PATH_MAX], out[CHECK_PATH_MAX];
+		if (check_temp_file(in, msg, len) != 0) {
+			return -1;
+		}
+		if (check_temp_file(out, NULL, 0) != 0) {
+			unlink(in);
+			return -1;
+		}
+		if (stream_file(mode, in, out, 0, 8, 0) == 0) {
+			*ctlen = check_read_file(out, ct, reflen);
+		}
+		if (write_whole_file(in, ref, reflen) == 0 && stream_file(mode, in, out, 1, 8, 0) == 0) {
+			*ptlen = check_read_file(out, pt, len);
+		}
+		unlink(in);
+		unlink(out);
+	}
+	return 0;
+}
+
+// Random messages of every tail length through every path.
+static void check_paths(KEYTYPE key, struct BATCHER *batcher) {
+	static const size_t whole[] = { 0, 1, 7, 8, 31, 64, 65, 200 };
+	unsigned char msg[8*201], ref[8*202], ct[8*203], pt[8*203];
+	DESKEY k;
+	size_t w, t, i;
+	int mode, p;
+	des_key_init(&k, key);
+	for (w=0; w<sizeof(whole) / sizeof(whole[0]); w++) {
+		for (t=0; t<=8; t++) {
+			size_t len = 8*whole[w] + t;
+			for (i=0; i<len; i++) {
+				msg[i] = (unsigned char) check_random();
+			}
+			for (mode=DES_ECB; mode<=DES_CTR; mode++) {
+				size_t reflen = check_reference(mode, msg, len, ref);
+				for (p=0; p<CHECK_PATHS; p++) {
+					long ctlen, ptlen;
+					int r = check_path(p, mode, &k, batcher, msg, len, ref, reflen, ct, &ctlen, pt, &ptlen);
+					if (r == 1) {
+						continue;
+					}
+					if (r == 2) {
+						r = 0;
+					} else if (r != 0 || ctlen != (long) reflen || memcmp(ct, ref, reflen) != 0) {
+						check_fail("encrypt", check_path_names[p], key, mode, (long) len);
+					}
+					if (r != 0 || ptlen != (long) len || memcmp(pt, msg, len) != 0) {
+						check_fail("decrypt", check_path_names[p], key, mode, (long) len);
+					}
+				}
+			}
+		}
+	}
+}
+
+// The batch path: a directory of messages of assorted lengths, one of them
+// big enough to be split across the workers, encrypted and then decrypted
+// by run_batch in both modes and compared with the reference.
+static void check_batch(KEYTYPE key) {
+	static const size_t lengths[] = { 0, 1, 8, 13, 1000, 4099 };
+	size_t nfiles = sizeof(lengths) / sizeof(lengths[0]) + 1, big = batch_chunk + 13, f;
+	unsigned char *msg = malloc(big), *ref = malloc(big + 8), *got = malloc(big + 8);
+	char dir[CHECK_PATH_MAX], path[CHECK_PATH_MAX + 16];
+	int mode;
+	if (msg == NULL || ref == NULL || got == NULL) {
+		check_fail("start", "batch", key, DES_ECB, -1);
+		goto done;
+	}
+	for (f=0; f<big; f++) {
+		msg[f] = (unsigned char) check_random();
+	}
+	for (mode=DES_ECB; mode<=DES_CTR; mode++) {
+		struct BATCH batch;
+		int bad = 0;
+		snprintf(dir, sizeof(dir), "/tmp/des_check.XXXXXX");
+		if (mkdtemp(dir) == NULL) {
+			check_fail("start", "batch", key, mode, -1);
+			continue;
+		}
+		for (f=0; f<nfiles; f++) {
+			snprintf(path, sizeof(path), "%s/m%d", dir, (int) f);
+			bad |= write_whole_file(path, msg, f < nfiles - 1 ? lengths[f] : big) != 0;
+		}
+		memset(&batch, 0, sizeof(batch));
+		batch.mode = mode;
+		batch.quiet = 1;
+		bad |= run_batch(dir, &batch, 2) != 0;
+		for (f=0; f<nfiles && !bad; f++) {
+			size_t len = f < nfiles - 1 ? lengths[f] : big;
+			size_t reflen = check_reference(mode, msg, len, ref);
+			snprintf(path, sizeof(path), "%s/m%d.des", dir, (int) f);
+			bad |= check_read_file(path, got, big + 8) != (long) reflen || memcmp(got, ref, reflen) != 0;
+			snprintf(path, sizeof(path), "%s/m%d", dir, (int) f);
+			unlink(path);
+		}
+		if (bad) {
+			check_fail("encrypt", "batch", key, mode, -1);
+		} else {
+			batch.decrypting = 1;
+			bad = run_batch(dir, &batch, 2) != 0;
+			for (f=0; f<nfiles && !bad; f++) {
+				size_t len = f < nfiles - 1 ? lengths[f] : big;
+				snprintf(path, sizeof(path), "%s/m%d", dir, (int) f);
+				bad |= check_read_file(path, got, big) != (long) len || memcmp(got, msg, len) != 0;
+			}
+			if (bad) {
+				check_fail("decrypt", "batch", key, mode, -1);
+			}
+		}
+		for (f=0; f<nfiles; f++) {
+			snprintf(path, sizeof(path), "%s/m%d", dir, (int) f);
+			unlink(path);
+			snprintf(path, sizeof(path), "%s/m%d.des", dir, (int) f);
+			unlink(path);
+		}
+		rmdir(dir);
+	}
+done:
+	free(msg);
+	free(ref);
+	free(got);
+}
+
+// The in-place path promises not to allocate. The allocations can only be
+// counted in the des_alloc_check build (see des_alloc_check.c), which links
+// DES.c with malloc, calloc and realloc wrapped; DES.c itself leaves the
+// allocator alone.
+#ifdef DES_ALLOC_CHECK
+#define CHECK_ALLOCS 1
+extern int des_alloc_counting;
+extern long des_allocs;
+#else
+#define CHECK_ALLOCS 0
+#endif
+
+// Count the allocations des_encrypt_inplace and des_decrypt_inplace make,
+// in both modes, with and without a tag, over a range of lengths. Returns
+// -1 if they can't be counted here.
+static int check_allocations(KEYTYPE key) {
+#if CHECK_ALLOCS
+	static const size_t lengths[] = { 0, 5, 8, 63, 1000, 100000 };
+	static unsigned char buf[100000 + 8 + DES_TAG_SIZE];
+	DESCTX ctx;
+	size_t l;
+	int mode, mac;
+	for (mode=DES_ECB; mode<=DES_CTR; mode++) {
+		for (mac=0; mac<=1; mac++) {
+			for (l=0; l<sizeof(lengths) / sizeof(lengths[0]); l++) {
+				long n;
+				memset(buf, 0x3c, lengths[l]);
+				des_ctx_init(&ctx, mode);
+				ctx.mac = mac;
+				des_allocs = 0;
+				des_alloc_counting = 1;
+				n = des_encrypt_inplace(&ctx, buf, lengths[l], sizeof(buf));
+				des_ctx_init(&ctx, mode);
+				ctx.mac = mac;
+				if (n > 0) {
+					n = des_decrypt_inplace(&ctx, buf, (size_t) n, sizeof(buf));
+				}
+				des_alloc_counting = 0;
+				if (n != (long) lengths[l] || des_allocs != 0) {
+					check_fail("alloc", mac ? "inplace+mac" : "inplace", key, mode, (long) lengths[l]);
+				}
+			}
+		}
+	}
+	return 0;
+#else
+	(void) key;
+	return -1;
+#endif
+}
+
+// MB/s of engine e: the best of three runs of at least CHECK_PERF_SECONDS.
+// 0 if the CPU doesn't have it.
+static double check_throughput(int e, BLOCKTYPE *blocks, size_t n) {
+	double best = 0;
+	int run;
+	for (run=0; run<3; run++) {
+		double start = now_seconds(), t;
+		long passes = 0;
+		do {
+			if (check_engine(e, blocks, n, 0) != 0) {
+				return 0;
+			}
+			passes++;
+		} while ((t = now_seconds() - start) < CHECK_PERF_SECONDS);
+		double rate = passes * 8.0 * n / t / 1e6;
+		if (rate > best) {
+			best = rate;
+		}
+	}
+	return best;
+}
+
+// Time the engines and compare them with the baseline in path, or with save
+// set, write it. Having no baseline to compare with is a failure.
+static void check_performance(const char *path, int save, long threshold) {
+	static BLOCKTYPE blocks[CHECK_PERF_BYTES / 8];
+	double rate[CHECK_ENGINES], base[CHECK_ENGINES];
+	char name[64];
+	double value;
+	int e, have = 0, slow = 0;
+	FILE *fp = save ? NULL : fopen(path, "r");
+	for (e=0; e<CHECK_ENGINES; e++) {
+		base[e] = 0;
+	}
+	while (fp != NULL && fscanf(fp, "%63s %lf", name, &value) == 2) {
+		for (e=0; e<CHECK_ENGINES; e++) {
+			if (!strcmp(name, check_engine_names[e])) {
+				base[e] = value;
+				have = 1;
+			}
+		}
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	memset(blocks, 0x5a, sizeof(blocks));
+	printf("engine          MB/s  baseline\n");
+	for (e=0; e<CHECK_ENGINES; e++) {
+		rate[e] = check_throughput(e, blocks, CHECK_PERF_BYTES / 8);
+		if (rate[e] == 0) {
+			continue;
+		}
+		printf("%-12s %7.1f  ", check_engine_names[e], rate[e]);
+		if (!have || base[e] == 0) {
+			printf("%8s\n", "-");
+		} else if (rate[e] < base[e] * (100 - threshold) / 100) {
+			printf("%8.1f  SLOWER by %.0f%%\n", base[e], 100 * (1 - rate[e] / base[e]));
+			slow++;
+		} else {
+			printf("%8.1f\n", base[e]);
+		}
+	}
+	if (slow) {
+		printf("FAILED: slower than the baseline by more than the threshold\n");
+		check_failures += slow;
+	}
+	if (!have && !save) {
+		printf("FAILED: no baseline in %s; make one with des -check -save\n", path);
+		check_failures++;
+	} else if (save) {
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			printf("FAILED: can't write the baseline %s\n", path);
+			check_failures++;
+			return;
+		}
+		for (e=0; e<CHECK_ENGINES; e++) {
+			if (rate[e] > 0) {
+				fprintf(fp, "%s %.1f\n", check_engine_names[e], rate[e]);
+			}
+		}
+		fclose(fp);
+		printf("baseline saved in %s\n", path);
+	}
+}
+
+// Run all the checks, with random inputs from seed (0 for a random seed)
+// and the baseline in "baseline" (NULL for the host's). Returns 0 if
+// everything passed, 1 if not.
+int des_check(uint64_t seed, const char *baseline, int save, long threshold) {
+	char path[1024];
+	uint64_t saved[16];
+	KEYTYPE key = 0;
+	int i, failed;
+	for (i=0; i<16; i++) {
+		saved[i] = getSubKey(i);
+	}
+	check_rng = seed;
+	if (check_rng == 0) {
+		check_rng = mitm_random() | 1;
+	}
+	printf("seed %llu\n", (unsigned long long) check_rng);
+	check_failures = 0;
+	table_init();
+	check_kat();
+	struct BATCHER *batcher = batcher_start(2, 0);
+	for (i=0; i<CHECK_KEYS; i++) {
+		key = check_random() & 0x00FFFFFFFFFFFFFFull;
+		check_set_key(key);
+		check_engines(key);
+		check_lanes(key);
+		check_keystream(key);
+		if (batcher != NULL) {
+			check_paths(key, batcher);
+		}
+	}
+	if (batcher != NULL) {
+		batcher_stop(batcher);
+	} else {
+		check_fail("start", "batcher", 0, DES_ECB, -1);
+	}
+	check_batch(key);
+	printf("%s: %d known answers, %d random keys, engines and paths\n",
+			check_failures ? "FAILED" : "ok", (int) (sizeof(check_kats) / sizeof(check_kats[0])), CHECK_KEYS);
+	failed = check_failures;
+	if (check_allocations(key) != 0) {
+		printf("skipped: allocations are only counted by the des_alloc_check build\n");
+	} else {
+		printf("%s: no allocations on the in-place path\n", check_failures > failed ? "FAILED" : "ok");
+	}
+
+	memcpy(generated_subkeys, saved, sizeof(saved));     // put the user's key back
+	subkeys_in_use = generated_subkeys;
+	table_load_subkeys();
+	if (baseline != NULL) {
+		snprintf(path, sizeof(path), "%s", baseline);
+	} else {
+		host_file_path(path, sizeof(path), ".des_check");
+	}
+	check_performance(path, save, threshold);
+	return check_failures ? 1 : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Main routine
+/////////////////////////////////////////////////////////////////////////////
+
+// Returns the position of an optional flag such as "-prefetch" in argv, or 0
+// if it wasn't given. Optional flags come after the mode.
+int find_flag(int argc, char **argv, const char *flag) {
+	int i;
+	for (i=3; i<argc; i++) {
+		if (!strcmp(argv[i], flag)) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+// Returns the numeric argument following the flag at argv[pos], or def if
+// there's none.
+long flag_number(int argc, char **argv, int pos, long def) {
+	char *end;
+	if (pos == 0 || pos+1 >= argc) {
+		return def;
+	}
+	long n = strtol(argv[pos+1], &end, 0);
+	return (*end == '\0' && end != argv[pos+1]) ? n : def;
+}
+
+// Start the CTR keystream generator if "-prefetch" was given.
+void start_prefetch(int argc, char **argv) {
+	int pos = find_flag(argc, argv, "-prefetch");
+	if (pos && !strcmp(argv[2], "-ctr")) {
+		ctr_keystream = keystream_start(0, 64*KS_SEGMENT, (int) flag_number(argc, argv, pos, 0));
+	}
+}
+
+void stop_prefetch(void) {
+	struct KEYSTREAM_STATS stats;
+	if (ctr_keystream == NULL) {
+		return;
+	}
+	keystream_stats(ctr_keystream, &stats);
+	fprintf(stderr, "keystream: %llu blocks used, %llu ahead (max %llu), %llu stalls, %llu full waits\n",
+			(unsigned long long) stats.consumed, (unsigned long long) stats.ahead,
+			(unsigned long long) stats.max_ahead, (unsigned long long) stats.stalls,
+			(unsigned long long) stats.full);
+	keystream_stop(ctr_keystream);
+	ctr_keystream = NULL;
+}
+
+// The value of "-armor", ARMOR_NONE if it wasn't given, or -1 if it's wrong.
+int armor_flag(int argc, char **argv) {
+	int pos = find_flag(argc, argv, "-armor");
+	if (pos == 0) {
+		return ARMOR_NONE;
+	}
+	int armor = armor_kind(pos+1 < argc ? argv[pos+1] : NULL);
+	if (armor < 0) {
+		printf("-armor should be followed by hex or base64\n");
+	}
+	return armor;
+}
+
+// Run "-batch LIST" if it was given. Returns 1 if it was, 0 otherwise, and
+// sets *status to 1 if the list couldn't be read or any file failed.
+int maybe_run_batch(int argc, char **argv, int decrypting, int *status) {
+	int pos = find_flag(argc, argv, "-batch");
+	if (pos == 0) {
+		return 0;
+	}
+	int armor = armor_flag(argc, argv);
+	*status = 1;
+	if (pos+1 >= argc) {
+		printf("-batch needs a list file or a directory\n");
+	} else if (strcmp(argv[2], "-ecb") && strcmp(argv[2], "-ctr")) {
+		printf("No such mode.\n");
+	} else if (armor >= 0) {
+		struct BATCH batch;
+		memset(&batch, 0, sizeof(batch));
+		batch.mode = strcmp(argv[2], "-ecb") ? DES_CTR : DES_ECB;
+		batch.decrypting = decrypting;
+		batch.mac = find_flag(argc, argv, "-mac") != 0;
+		batch.armor = armor;
+		batch.numa = find_flag(argc, argv, "-numa") != 0;
+		batch.compress = find_flag(argc, argv, "-z") != 0;
+		int threads = batch.numa ? 0 : batch_threads;
+		*status = run_batch(argv[pos+1], &batch, (int) flag_number(argc, argv, find_flag(argc, argv, "-threads"), threads)) != 0;
+	}
+	return 1;
+}
+
+// With "-mac", "-armor" or "-z", the hardcoded files are processed in memory
+// by crypt_file, since the tag, the text or the compressed stream don't fit
+// in a BLOCKLIST. Returns 1 if that was done, and sets *status to 1 if it
+// failed.
+int maybe_run_buffered(int argc, char **argv, int decrypting, int *status) {
+	DESCTX ctx;
+	int compress = find_flag(argc, argv, "-z") != 0;
+	if (!find_flag(argc, argv, "-mac") && !find_flag(argc, argv, "-armor") && !compress) {
+		return 0;
+	}
+	int armor = armor_flag(argc, argv);
+	if (armor < 0) {
+		*status = 1;
+		return 1;
+	}
+	if (strcmp(argv[2], "-ecb") && strcmp(argv[2], "-ctr")) {
+		printf("No such mode.\n");
+		*status = 1;
+		return 1;
+	}
+	des_ctx_init(&ctx, strcmp(argv[2], "-ecb") ? DES_CTR : DES_ECB);
+	ctx.mac = find_flag(argc, argv, "-mac") != 0;
+	start_prefetch(argc, argv);
+	ctx.keystream = ctr_keystream;
+	int result;
+	if (decrypting) {
+		result = crypt_file(&ctx, "encrypted_msg.bin", "decrypted_message.txt", 1, armor, compress);
+	} else {
+		result = crypt_file(&ctx, "message.txt", "encrypted_msg.bin", 0, armor, compress);
+	}
+	stop_prefetch();
+	if (result != 0) {
+		fprintf(stderr, decrypting ? "Decryption failed: the message was damaged or the key is wrong.\n"
+				: "Encryption failed.\n");
+		*status = 1;
+	}
+	return 1;
+}
+
+// With "-checkpoint [MB]" or "-resume", stream the hardcoded files through
+// stream_file. Returns 1 if that was done, and sets *status to 1 if it
+// failed. This has to be tried before maybe_run_buffered, which would
+// otherwise take the job and drop the checkpoints.
+int maybe_run_checkpointed(int argc, char **argv, int decrypting, int *status) {
+	int pos = find_flag(argc, argv, "-checkpoint");
+	int resume = find_flag(argc, argv, "-resume") != 0;
+	if (pos == 0 && !resume) {
+		return 0;
+	}
+	*status = 1;
+	if (find_flag(argc, argv, "-mac") || find_flag(argc, argv, "-armor") || find_flag(argc, argv, "-z")) {
+		printf("-checkpoint can't be combined with -mac, -armor or -z\n");
+		return 1;
+	}
+	if (strcmp(argv[2], "-ecb") && strcmp(argv[2], "-ctr")) {
+		printf("No such mode.\n");
+		return 1;
+	}
+	long mb = flag_number(argc, argv, pos, 256);
+	int mode = strcmp(argv[2], "-ecb") ? DES_CTR : DES_ECB;
+	int result;
+	if (decrypting) {
+		result = stream_file(mode, "encrypted_msg.bin", "decrypted_message.txt", 1, (size_t) mb << 20, resume);
+	} else {
+		result = stream_file(mode, "message.txt", "encrypted_msg.bin", 0, (size_t) mb << 20, resume);
+	}
+	if (result != 0) {
+		fprintf(stderr, "Stopped; run again with -resume to continue from the last checkpoint.\n");
+	} else {
+		*status = 0;
+	}
+	return 1;
+}
+
+// "-offset N" and "-length N" decrypt only that part of encrypted_msg.bin
+// (from N to the end, or the first N bytes, if only one is given) through a
+// DESREADER, and write it to stdout. Returns 1 if that was done, and sets
+// *status to 1 if it failed.
+int maybe_run_reader(int argc, char **argv, int decrypting, int *status) {
+	static unsigned char buf[READER_CHUNK];
+	int offset = find_flag(argc, argv, "-offset"), length = find_flag(argc, argv, "-length");
+	if (!decrypting || (offset == 0 && length == 0)) {
+		return 0;
+	}
+	*status = 1;
+	if (strcmp(argv[2], "-ecb") && strcmp(argv[2], "-ctr")) {
+		printf("No such mode.\n");
+		return 1;
+	}
+	DESREADER *r = des_reader_open("encrypted_msg.bin", strcmp(argv[2], "-ecb") ? DES_CTR : DES_ECB);
+	if (r == NULL) {
+		fprintf(stderr, "Can't read encrypted_msg.bin, or it isn't whole blocks.\n");
+		return 1;
+	}
+	long left = flag_number(argc, argv, length, -1), n = 0;
+	if (des_reader_seek(r, flag_number(argc, argv, offset, 0), SEEK_SET) < 0) {
+		fprintf(stderr, "Can't seek to that offset.\n");
+	} else {
+		while (left != 0) {
+			n = des_reader_read(r, buf, left < 0 || left > READER_CHUNK ? READER_CHUNK : (size_t) left);
+			if (n <= 0) {
+				break;
+			}
+			if (fwrite(buf, 1, n, stdout) != (size_t) n) {
+				fprintf(stderr, "Can't write the output.\n");
+				break;
+			}
+			left -= left > 0 ? n : 0;
+		}
+		if (n < 0) {
+			fprintf(stderr, "Decryption failed: the message was damaged or the key is wrong.\n");
+		} else if (left == 0 || n == 0) {
+			*status = 0;
+		}
+	}
+	des_reader_close(r);
+	return 1;
+}
+
+// With no optional flags, a message small enough for des_encrypt_small is
+// read with one read() into a stack buffer and written with one write(),
+// instead of going through a list. Returns 1 if that was done, and sets
+// *status to 1 if it failed.
+int maybe_run_small(int argc, char **argv, int decrypting, int *status) {
+	unsigned char in[8*DES_SMALL_BLOCKS + 1], out[8*DES_SMALL_BLOCKS];
+	DESCTX ctx;
+	if (argc != 3 || (strcmp(argv[2], "-ecb") && strcmp(argv[2], "-ctr"))) {
+		return 0;
+	}
+	int fd = open(decrypting ? "encrypted_msg.bin" : "message.txt", O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t len = read(fd, in, sizeof in);
+	close(fd);
+	if (len < 0 || len > (decrypting ? 8*DES_SMALL_BLOCKS : DES_SMALL_MAX)) {
+		return 0;
+	}
+	des_ctx_init(&ctx, strcmp(argv[2], "-ecb") ? DES_CTR : DES_ECB);
+	long n = decrypting ? des_decrypt_small(&ctx, in, len, out) : des_encrypt_small(&ctx, in, len, out);
+	if (n < 0) {
+		fprintf(stderr, "Decryption failed: the message was damaged or the key is wrong.\n");
+		*status = 1;
+		return 1;
+	}
+	fd = open(decrypting ? "decrypted_message.txt" : "encrypted_msg.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, out, n) != n) {
+		fprintf(stderr, "Can't write the output file.\n");
+		*status = 1;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return 1;
+}
+
+// Returns the exit status: 0, or 1 if anything failed.
+int encrypt (int argc, char **argv) {
+     int status = 0;
+     if (maybe_run_batch(argc, argv, 0, &status) || maybe_run_checkpointed(argc, argv, 0, &status)
+           || maybe_run_buffered(argc, argv, 0, &status) || maybe_run_small(argc, argv, 0, &status)) {
+        return status;
+     }
+     FILE *msg_fp = fopen("message.txt", "r");
+     if (msg_fp == NULL) {
+        fprintf(stderr, "Can't read message.txt.\n");
+        return 1;
+     }
+     start_prefetch(argc, argv);
+     BLOCKLIST msg = read_cleartext_message(msg_fp);
+     fclose(msg_fp);
+
+     BLOCKLIST encrypted_message = NULL;
+     if (!strcmp(argv[2], "-ecb")) {
+        encrypted_message = des_enc_ECB(msg);
+     } else if (!strcmp(argv[2], "-ctr")) {
+        encrypted_message = des_enc_CTR(msg);
+     } else {
+        printf("No such mode.\n");
+        status = 1;
+     };
+     stop_prefetch();
+     FILE *encrypted_msg_fp = fopen("encrypted_msg.bin", "wb");
+     if (encrypted_msg_fp == NULL) {
+        fprintf(stderr, "Can't write the output file.\n");
+        return 1;
+     }
+     status |= write_encrypted_message(encrypted_msg_fp, encrypted_message);
+     fclose(encrypted_msg_fp);
+     return status;
+}
+
+// Returns the exit status: 0, or 1 if anything failed (a damaged message or a
+// wrong key included).
+int decrypt (int argc, char **argv) {
+     int status = 0;
+//      FILE *encrypted_msg_fp = fopen("encrypted_msg.bin", "wb");
+     if (maybe_run_batch(argc, argv, 1, &status) || maybe_run_checkpointed(argc, argv, 1, &status)
+           || maybe_run_buffered(argc, argv, 1, &status) || maybe_run_reader(argc, argv, 1, &status)
+           || maybe_run_small(argc, argv, 1, &status)) {
+        return status;
+     }
+	  FILE *encrypted_msg_fp = fopen("encrypted_msg.bin", "rb");
+     if (encrypted_msg_fp == NULL) {
+        fprintf(stderr, "Can't read encrypted_msg.bin.\n");
+        return 1;
+     }
+     start_prefetch(argc, argv);
+     BLOCKLIST encrypted_message = read_encrypted_file(encrypted_msg_fp);
+     fclose(encrypted_msg_fp);
+
+     BLOCKLIST decrypted_message = NULL;
+     if (!strcmp(argv[2], "-ecb")) {
+        decrypted_message = des_dec_ECB(encrypted_message);
+     } else if (!strcmp(argv[2], "-ctr")) {
+        decrypted_message = des_dec_CTR(encrypted_message);
+     } else {
+        printf("No such mode.\n");
+        status = 1;
+     };
+     stop_prefetch();
+
+//      FILE *decrypted_msg_fp = fopen("decrypted_message.txt", "r");
+     FILE *decrypted_msg_fp = fopen("decrypted_message.txt", "wb");
+     if (decrypted_msg_fp == NULL) {
+        fprintf(stderr, "Can't write the output file.\n");
+        return 1;
+     }
+     status |= write_decrypted_message(decrypted_msg_fp, decrypted_message);
+     fclose(decrypted_msg_fp);
+     return status;
+}
+
+
+// "des -bench -scaling [-size MB] [-threads N]". N is the number of threads
+// per node; by default every CPU of each node is used.
+// "des -bench -latency [-samples N]", "des -bench -keys".
+// "des -bench -streams [-messages N] [-size BYTES] [-clients N] [-depth N]
+// [-threads N] [-delay US]": -threads is the number of batcher threads.
+void bench(int argc, char **argv) {
+	if (argc > 2 && !strcmp(argv[2], "-scaling")) {
+		long mb = flag_number(argc, argv, find_flag(argc, argv, "-size"), 256);
+		bench_scaling((size_t) mb << 20, (int) flag_number(argc, argv, find_flag(argc, argv, "-threads"), 0));
+	} else if (argc > 2 && !strcmp(argv[2], "-latency")) {
+		bench_latency(flag_number(argc, argv, find_flag(argc, argv, "-samples"), LATENCY_SAMPLES));
+	} else if (argc > 2 && !strcmp(argv[2], "-keys")) {
+		bench_keys();
+	} else if (argc > 2 && !strcmp(argv[2], "-streams")) {
+		bench_streams(flag_number(argc, argv, find_flag(argc, argv, "-messages"), 200000),
+				flag_number(argc, argv, find_flag(argc, argv, "-size"), 32),
+				(int) flag_number(argc, argv, find_flag(argc, argv, "-clients"), 16),
+				(int) flag_number(argc, argv, find_flag(argc, argv, "-depth"), 16),
+				(int) flag_number(argc, argv, find_flag(argc, argv, "-threads"), 0),
+				flag_number(argc, argv, find_flag(argc, argv, "-delay"), 50));
+	} else {
+		printf("No such benchmark.\n");
+	}
+}
+
+// "des -mitm BITS [-threads N] [-mem MB] [-spill DIR]".
+void run_mitm(int argc, char **argv) {
+	long mb = (long) ((double) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2 / (1 << 20));
+	int spill = find_flag(argc, argv, "-spill");
+	if (argc < 3) {
+		printf("-mitm needs the number of key bits to search\n");
+		return;
+	}
+	mb = flag_number(argc, argv, find_flag(argc, argv, "-mem"), mb);
+	mitm(atoi(argv[2]), (int) flag_number(argc, argv, find_flag(argc, argv, "-threads"), 0),
+			(size_t) mb << 20, spill > 0 && spill+1 < argc ? argv[spill+1] : NULL);
+}
+
+// -check has no mode, so its first flag is argv[2].
+static int check_flag(int argc, char **argv, const char *flag) {
+	return argc > 2 && !strcmp(argv[2], flag) ? 2 : find_flag(argc, argv, flag);
+}
+
+// "des -check [-seed N] [-threshold PCT] [-baseline FILE] [-save]".
+int run_check(int argc, char **argv) {
+	int pos = check_flag(argc, argv, "-baseline");
+	return des_check((uint64_t) flag_number(argc, argv, check_flag(argc, argv, "-seed"), 0),
+			pos > 0 && pos+1 < argc ? argv[pos+1] : NULL, check_flag(argc, argv, "-save") != 0,
+			flag_number(argc, argv, check_flag(argc, argv, "-threshold"), CHECK_THRESHOLD));
+}
+
+#ifndef DES_LIBRARY
+int main(int argc, char **argv){
+  FILE *key_fp = fopen("key.txt","r");
+  if (key_fp != NULL) {
+     KEYTYPE key;
+     int bad = read_key(key_fp, &key);
+     fclose(key_fp);
+     if (bad) {
+        fprintf(stderr, "key.txt should hold one hex number of at most 56 bits, such as 0x34FA879B.\n");
+        return 1;
+     }
+     generateSubKeys(key);
+  }
+  tune_setup(argc > 1 && !strcmp(argv[1], "-tune"));
+  int trace = find_flag(argc, argv, "-trace");
+  if (trace > 0 && trace+1 < argc) {
+     trace_start();
+  }
+
+  int status = 0;
+  if (argc < 2) {
+    printf("First argument should be -enc, -dec, -bench, -tune, -mitm or -check\n");
+  } else if (!strcmp(argv[1], "-enc")) {
+     status = encrypt(argc, argv);
+  } else if (!strcmp(argv[1], "-dec")) {
+     status = decrypt(argc, argv);
+  } else if (!strcmp(argv[1], "-bench")) {
+     bench(argc, argv);
+  } else if (!strcmp(argv[1], "-tune")) {
+     tune_report();
+  } else if (!strcmp(argv[1], "-mitm")) {
+     run_mitm(argc, argv);
+  } else if (!strcmp(argv[1], "-check")) {
+     status = run_check(argc, argv);
+  } else {
+    printf("First argument should be -enc, -dec, -bench, -tune, -mitm or -check\n");
+  }
+  if (trace > 0 && trace+1 < argc) {
+     trace_write(argv[trace+1]);
+  }
+   return status;
+}
+#endif
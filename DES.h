@@ -0,0 +1,77 @@
+#ifndef DES_H
+#define DES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+ /*
+ * The parts of DES.c that other programs can call. Build DES.c with
+ * -DDES_LIBRARY to leave out its main, and link with -lpthread. des_async.hpp
+ * wraps the batcher for C++20 coroutines.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DES_ECB 0
+#define DES_CTR 1
+
+// A key's schedules for the engines, cut up once when the key is set.
+typedef struct DESKEY {
+	unsigned char enc[16][8];
+	unsigned char dec[16][8];
+} DESKEY;
+
+// One message for the batcher: nblocks blocks at buf, encrypted or decrypted
+// in place. The caller fills in the first fields and must leave the job and
+// the buffer alone until batcher_wait returns, or until finished is called.
+typedef struct DESJOB {
+	int mode;               // DES_ECB or DES_CTR
+	int decrypting;         // ECB only, CTR is the same both ways
+	DESKEY *key;
+	uint64_t counter;       // CTR: counter of the first block
+	unsigned char *buf;
+	size_t nblocks;
+	// If set, called on a batcher thread once the blocks are done, instead
+	// of waking batcher_wait. The job is the caller's again from then on.
+	void (*finished)(struct DESJOB *job);
+	void *arg;              // for finished
+	// the batcher's
+	size_t next;            // blocks handed to a batch so far
+	size_t done;            // blocks finished
+	uint64_t deadline;      // when the batcher stops waiting for more blocks
+	pthread_cond_t ready;   // signalled when done reaches nblocks
+	struct DESJOB *link;
+} DESJOB;
+
+struct BATCHER;
+
+// Pick the engines for this CPU and load the profile of "des -tune", if
+// there is one. batcher_start and des_reader_open do it themselves.
+void des_init(void);
+
+void des_key_init(DESKEY *k, uint64_t key);
+size_t des_padded_length(size_t len);
+size_t des_pad_inplace(unsigned char *buf, size_t len);
+long des_unpadded_length(const unsigned char *buf, size_t len);
+
+struct BATCHER *batcher_start(int nthreads, long max_delay_us);
+void batcher_submit(struct BATCHER *b, DESJOB *job);
+void batcher_wait(struct BATCHER *b, DESJOB *job);
+void batcher_stop(struct BATCHER *b);
+
+typedef struct DESREADER DESREADER;
+
+DESREADER *des_reader_open(const char *path, int mode);
+long des_reader_read(DESREADER *r, void *buf, size_t n);
+long des_reader_seek(DESREADER *r, long off, int whence);
+long des_reader_size(DESREADER *r);
+void des_reader_close(DESREADER *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+// Counts allocations for "des -check", which uses the count to make sure the
+// in-place path never allocates. DES.c doesn't touch the allocator itself;
+// this file is linked in only for the check, with the linker sending DES.c's
+// calls to malloc, calloc and realloc here. Build it with (all one command)
+//
+//	gcc -O3 -DDES_ALLOC_CHECK -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+//	    DES.c des_alloc_check.c -lpthread -o des_alloc_check
+//
+// and run "./des_alloc_check -check" where des would be run.
+
+#include <stddef.h>
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+
+int des_alloc_counting;         // count the calls while this is set
+long des_allocs;                // the count, updated atomically
+
+void *__wrap_malloc(size_t n) {
+	if (des_alloc_counting) {
+		__atomic_add_fetch(&des_allocs, 1, __ATOMIC_RELAXED);
+	}
+	return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+	if (des_alloc_counting) {
+		__atomic_add_fetch(&des_allocs, 1, __ATOMIC_RELAXED);
+	}
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+	if (des_alloc_counting) {
+		__atomic_add_fetch(&des_allocs, 1, __ATOMIC_RELAXED);
+	}
+	return __real_realloc(p, n);
+}
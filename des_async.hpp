@@ -0,0 +1,169 @@
+#ifndef DES_ASYNC_HPP
+#define DES_ASYNC_HPP
+
+// C++20 coroutine API over the DES batcher. Header only; link with DES.c
+// built with -DDES_LIBRARY.
+//
+//	des::engine engine;                       // batcher threads, one per core
+//	des::key key(0x12695bc9b7b7f8);           // 56-bit key, as in key.txt
+//	des::buffer msg(std::span(bytes));        // copied once, owned from here on
+//	msg = co_await engine.encrypt_async(key, std::move(msg));
+//	msg = co_await engine.decrypt_async(key, std::move(msg));
+//
+// The buffer is moved into the operation and handed back by co_await, so
+// the batcher works on it in place and nothing is copied. The caller is
+// resumed on a batcher thread. Any number of coroutines can be waiting at
+// once: their blocks share SIMD batches and none of them holds a thread.
+// des_async_example.cpp is a whole program that does this, with its build
+// commands.
+
+#include <algorithm>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+#include "DES.h"
+
+namespace des {
+
+// A key with its schedules cut up, ready for the engines.
+class key {
+public:
+	explicit key(std::uint64_t k) { des_key_init(&k_, k); }
+
+private:
+	friend class crypt_op;
+	DESKEY k_;
+};
+
+// Bytes owned by one operation at a time. There is always room for the
+// padding, so encrypting doesn't reallocate.
+class buffer {
+public:
+	buffer() = default;
+	explicit buffer(std::size_t size)
+		: data_(new unsigned char[des_padded_length(size)]), size_(size) {}
+	explicit buffer(std::span<const unsigned char> bytes) : buffer(bytes.size()) {
+		std::copy(bytes.begin(), bytes.end(), data_.get());
+	}
+	buffer(buffer &&) noexcept = default;
+	buffer &operator=(buffer &&) noexcept = default;
+	buffer(const buffer &) = delete;
+	buffer &operator=(const buffer &) = delete;
+
+	std::span<unsigned char> span() { return { data_.get(), size_ }; }
+	std::span<const unsigned char> span() const { return { data_.get(), size_ }; }
+	unsigned char *data() { return data_.get(); }
+	std::size_t size() const { return size_; }
+
+private:
+	friend class crypt_op;
+	std::unique_ptr<unsigned char[]> data_;
+	std::size_t size_ = 0;
+};
+
+// What co_await engine.encrypt_async(...) waits on. The DESJOB lives in the
+// awaiting coroutine's frame until the batcher is done with it, so it can't
+// be copied or moved.
+class crypt_op {
+public:
+	crypt_op(struct BATCHER *b, const key &k, int mode, bool decrypting, buffer buf, std::uint64_t counter)
+		: batcher_(b), buf_(std::move(buf)), decrypting_(decrypting) {
+		job_ = {};
+		job_.mode = mode;
+		job_.decrypting = decrypting;
+		job_.key = const_cast<DESKEY *>(&k.k_);
+		job_.counter = counter;
+		job_.buf = buf_.data_.get();
+		job_.finished = &crypt_op::finished;
+		job_.arg = this;
+		if (decrypting) {
+			if (buf_.size_ == 0 || buf_.size_ % 8 != 0) {
+				bad_ = true;
+			}
+			job_.nblocks = buf_.size_ / 8;
+		} else {
+			job_.nblocks = buf_.data_ ? des_pad_inplace(buf_.data_.get(), buf_.size_) / 8 : 0;
+		}
+	}
+	crypt_op(const crypt_op &) = delete;
+	crypt_op &operator=(const crypt_op &) = delete;
+
+	bool await_ready() const noexcept { return bad_ || job_.nblocks == 0; }
+
+	// The batcher may resume the caller before batcher_submit returns, so
+	// nothing here touches *this after it.
+	void await_suspend(std::coroutine_handle<> caller) {
+		caller_ = caller;
+		batcher_submit(batcher_, &job_);
+	}
+
+	// The encrypted buffer is padded to whole blocks; the decrypted one is
+	// cut back to the real bytes.
+	buffer await_resume() {
+		if (bad_) {
+			throw std::invalid_argument("des: ciphertext isn't a whole number of blocks");
+		}
+		if (decrypting_) {
+			long n = des_unpadded_length(buf_.data_.get(), buf_.size_);
+			if (n < 0) {
+				throw std::runtime_error("des: bad padding, wrong key or damaged ciphertext");
+			}
+			buf_.size_ = static_cast<std::size_t>(n);
+		} else {
+			buf_.size_ = job_.nblocks * 8;
+		}
+		return std::move(buf_);
+	}
+
+private:
+	static void finished(DESJOB *job) {
+		static_cast<crypt_op *>(job->arg)->caller_.resume();
+	}
+
+	struct BATCHER *batcher_;
+	buffer buf_;
+	bool decrypting_;
+	bool bad_ = false;
+	DESJOB job_;
+	std::coroutine_handle<> caller_;
+};
+
+// The batcher threads. Operations in flight must finish before it's
+// destroyed.
+class engine {
+public:
+	explicit engine(int threads = 0, long max_delay_us = 50)
+		: batcher_(batcher_start(threads, max_delay_us)) {
+		if (batcher_ == nullptr) {
+			throw std::bad_alloc();
+		}
+	}
+	~engine() { batcher_stop(batcher_); }
+	engine(const engine &) = delete;
+	engine &operator=(const engine &) = delete;
+
+	// Pad and encrypt. In CTR mode the message's blocks use counters
+	// counter, counter+1, ...; never reuse a counter with the same key.
+	crypt_op encrypt_async(const key &k, buffer buf, int mode = DES_CTR, std::uint64_t counter = 0) {
+		return crypt_op(batcher_, k, mode, false, std::move(buf), counter);
+	}
+
+	// Decrypt and remove the padding. Throws from co_await if the padding
+	// is wrong.
+	crypt_op decrypt_async(const key &k, buffer buf, int mode = DES_CTR, std::uint64_t counter = 0) {
+		return crypt_op(batcher_, k, mode, true, std::move(buf), counter);
+	}
+
+private:
+	struct BATCHER *batcher_;
+};
+
+}
+
+#endif
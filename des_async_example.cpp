@@ -0,0 +1,66 @@
+// Encrypts and decrypts a few thousand short messages under a hundred keys,
+// all in flight at once through des_async.hpp, and checks that every one
+// comes back as it went in. Exits with 1 if any doesn't. Build it with
+//
+//	gcc -O3 -DDES_LIBRARY -c DES.c -o DES.o
+//	g++ -std=c++20 -O2 des_async_example.cpp DES.o -lpthread -o des_async_example
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "des_async.hpp"
+
+// The least a coroutine needs to run: it starts right away and cleans up
+// after itself when it's done.
+struct task {
+	struct promise_type {
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+static std::atomic<int> good{0}, bad{0}, finished{0};
+
+// One message of i % 70 bytes there and back. Every message has a counter
+// range of its own, so no counter is used twice with the same key.
+static task round_trip(des::engine &engine, const des::key &key, int i) {
+	std::vector<unsigned char> msg(i % 70);
+	for (std::size_t j = 0; j < msg.size(); j++) {
+		msg[j] = static_cast<unsigned char>(i * 7 + j);
+	}
+	int mode = i % 2 ? DES_ECB : DES_CTR;
+	std::uint64_t counter = static_cast<std::uint64_t>(i) << 20;
+	des::buffer buf{std::span<const unsigned char>(msg)};
+	buf = co_await engine.encrypt_async(key, std::move(buf), mode, counter);
+	buf = co_await engine.decrypt_async(key, std::move(buf), mode, counter);
+	if (buf.size() == msg.size() && std::memcmp(buf.data(), msg.data(), msg.size()) == 0) {
+		good++;
+	} else {
+		bad++;
+	}
+	finished++;
+}
+
+int main() {
+	const int messages = 10000;
+	des::engine engine;
+	std::vector<des::key> keys;
+	for (int i = 0; i < 100; i++) {
+		keys.emplace_back(0x12695bc9b7b7f8ull + i * 977);
+	}
+	for (int i = 0; i < messages; i++) {
+		round_trip(engine, keys[i % keys.size()], i);
+	}
+	while (finished < messages) {
+		std::this_thread::yield();
+	}
+	std::printf("%d messages, %d wrong\n", good.load() + bad.load(), bad.load());
+	return bad == 0 ? 0 : 1;
+}